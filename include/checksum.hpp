@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Checksum {
+
+// Standard reflected CRC-32 (polynomial 0xEDB88320), as used by zlib / PNG.
+// Pass the result of a previous call as `crc` to checksum data in pieces.
+uint32_t crc32(const uint8_t *data, size_t size, uint32_t crc = 0);
+
+// Returns true if every byte in the buffer is 0xFF, i.e. the region is in the
+// erased state for a NOR flash.
+bool is_erased(const uint8_t *data, size_t size);
+
+} // namespace Checksum
@@ -2,11 +2,15 @@
 
 #include <string>
 
-struct CliArgs {
+#include <options.hpp>
+
+struct CliArgs : public Faff::Options {
   void usage();
   bool parse(int argc, char **argv);
   bool valid();
   void report_errors();
+  // How many of program / read out / characterize were asked for
+  int modes_selected();
 
 public:
   // Were sufficient arguments parsed to perform a useful action, or should the
@@ -16,35 +20,38 @@ public:
   // Should we just print help and exit?
   bool _help_selected = false;
 
-  // Default VID:PID values are a test value from
-  // http://pid.codes/pids/
-  int _usb_vid = 0x1209;
-  int _usb_pid = 0x0001;
-  // The firmware this tool was designed to work with happens to have
-  // this as the interface number.
-  int _usb_interface = 2;
-
-  // Serial selection. If a serial number is specified in the cli args, only
-  // bind to a device with that serial. If no serial is specified, bind to any
-  // device that has the right vid:pid
-  bool _usb_serial_specified = false;
-  std::string _usb_serial = "";
-
-  // Transmit / receive endpoint numbers for the device.
-  int _usb_endpoint_tx = 0x02;
-  int _usb_endpoint_rx = 0x84;
-
   // The file path to try and load
   const char *_file_path = nullptr;
 
-  // Load address of the file.
-  // Defaults to the beginning of the flash.
-  unsigned _file_lma = 0x0;
-
-  // Should we read-back the programmed data to verify it
-  bool _verify_programmed = true;
-
   // If set, we should enumerate possible targets but not perform any other
   // action.
   bool _enumerate_only = false;
+
+  // If set, dump the flash contents to this path instead of programming.
+  // The dump starts at _file_lma.
+  const char *_read_out_path = nullptr;
+
+  // Number of bytes to dump. If not specified, read to the end of the flash
+  // as sized from the chip's device ID.
+  bool _read_length_specified = false;
+  unsigned _read_length = 0;
+
+  // Leave fully erased (0xFF) sectors in the dump as holes in the file
+  // rather than writing them out.
+  bool _read_out_sparse = false;
+
+  // Optional path to write a per-sector checksum manifest for the dump.
+  const char *_manifest_path = nullptr;
+
+  // Optional file of patches to apply on top of any given with --patch
+  const char *_patches_path = nullptr;
+
+  // If set, record a trace of every USB transfer to this path
+  const char *_trace_path = nullptr;
+
+  // If set, measure the link and flash and save a tuning profile instead of
+  // programming, using the 64k block at _scratch_addr if specified.
+  bool _characterize = false;
+  bool _scratch_specified = false;
+  unsigned _scratch_addr = 0;
 };
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdexcept>
+
+namespace Faff {
+
+// Thrown by libfaff for any failure that stops an operation: USB transfer
+// errors, flash timeouts, verify mismatches and so on. The message is suitable
+// for showing to a user as-is.
+class Error : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+} // namespace Faff
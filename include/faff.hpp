@@ -0,0 +1,261 @@
+#pragma once
+
+#include <libusb.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <error.hpp>
+#include <flash_parts.hpp>
+#include <options.hpp>
+#include <patch.hpp>
+#include <tuning.hpp>
+#include <usb_protocol.hpp>
+
+// libfaff: everything needed to find programmers and drive them, without the
+// command line front end. All failures are reported by throwing Faff::Error.
+namespace Faff {
+
+// Empty if the device has no serial number, or it can't be read
+std::string get_serial_for_device(libusb_device_handle *handle);
+std::string get_serial_for_device(libusb_device *dev);
+
+// A read-only image, either memory mapped from a file or built in memory
+struct BitstreamFile {
+  BitstreamFile(uint8_t *data, off_t size)
+      : _mapped(true), _data(data), _size(size) {}
+  explicit BitstreamFile(std::vector<uint8_t> buffer)
+      : _buffer(std::move(buffer)), _mapped(false), _data(_buffer.data()),
+        _size(_buffer.size()) {}
+  ~BitstreamFile() {
+    if (_mapped)
+      munmap(_data, _size);
+  }
+  BitstreamFile(const BitstreamFile &) = delete;
+  BitstreamFile &operator=(const BitstreamFile &) = delete;
+
+  // Backing store for images built in memory
+  std::vector<uint8_t> _buffer;
+  bool _mapped;
+
+  uint8_t *_data;
+  off_t _size;
+};
+
+// Returns nullptr if the file can't be opened or mapped
+std::unique_ptr<BitstreamFile> open_bitstream(const char *file_path);
+
+// A copy of `base` with `patches` stamped over it. The copy is extended with
+// erased (0xFF) bytes if a patch lies past the end of `base`. Throws
+// Faff::Error if a patch can't be resolved, two of them overlap, or one ends
+// more than `max_size` bytes into the image.
+std::unique_ptr<BitstreamFile>
+apply_patches(const BitstreamFile &base, const std::vector<Patch> &patches,
+              const PatchVariables &variables, uint64_t max_size = UINT64_MAX);
+
+struct Progress {
+  enum class Stage {
+    ERASE,
+    PROGRAM,
+    VERIFY,
+    READ,
+  };
+
+  Stage _stage;
+  // Bytes completed / total bytes for this stage
+  uint64_t _done;
+  uint64_t _total;
+};
+
+// Progress and log callbacks are invoked from the thread running the
+// operation, not the thread that started it.
+using ProgressCallback = std::function<void(const Progress &progress)>;
+using LogCallback = std::function<void(const std::string &message)>;
+// Receives flash contents in address order as they are read back
+using ReadCallback =
+    std::function<void(uint32_t addr, const uint8_t *data, uint32_t size)>;
+
+class Programmer;
+
+// Pass as the scratch address to Programmer::characterize to use the last
+// 64k block of the flash
+static const uint32_t scratch_at_end = UINT32_MAX;
+
+// Owns a libusb context. One context can open any number of programmers.
+class Context {
+public:
+  Context();
+  ~Context();
+  Context(const Context &) = delete;
+  Context &operator=(const Context &) = delete;
+
+  libusb_context *get() { return _usb_context; }
+
+  // Informational messages. Defaults to printing them to stderr.
+  void set_log_callback(LogCallback log) { _log = log; }
+
+  // Serial numbers of all connected devices matching options' VID:PID.
+  // Devices that can't be opened are logged and left out.
+  std::vector<std::string> enumerate(const Options &options);
+
+  // Open and claim the first device matching options' VID:PID, and serial if
+  // one is specified.
+  std::unique_ptr<Programmer> open(const Options &options);
+
+private:
+  void log(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+  libusb_context *_usb_context = nullptr;
+  LogCallback _log;
+};
+
+// A claimed programmer. Operations on one programmer are serialized, but
+// separate programmers can be driven concurrently.
+class Programmer {
+public:
+  Programmer(libusb_context *usb_context, libusb_device_handle *usb_handle,
+             const Options &options);
+  ~Programmer();
+  Programmer(const Programmer &) = delete;
+  Programmer &operator=(const Programmer &) = delete;
+
+  const std::string &serial() const { return _serial; }
+
+  // Direct access to the protocol layer, for anything not covered by the
+  // high level operations. Don't use it while an operation is in flight.
+  UsbProto::Session &session() { return _session; }
+
+  // Flash part found by the most recent operation
+  const FlashParts::FlashPart &part() const { return _part; }
+
+  // Tuning used by the most recent operation
+  const Tuning &tuning() const { return _tuning; }
+
+  // Informational messages. Defaults to printing them to stderr.
+  void set_log_callback(LogCallback log) { _log = log; }
+
+  // Hold the FPGA in reset, then erase, program and (unless disabled in
+  // options) verify `image` at options._file_lma before releasing it again.
+  // Any options._patches are stamped over the image first, with ${serial}
+  // set to this programmer's serial.
+  // With options._live the FPGA keeps running instead: the image goes into
+  // the inactive multiboot slot at options._file_lma, is always verified,
+  // and the boot header is then pointed at it.
+  // The returned future throws Faff::Error on failure. The programmer must
+  // outlive the future.
+  std::future<void> program(std::shared_ptr<const BitstreamFile> image,
+                            const Options &options,
+                            ProgressCallback progress = nullptr);
+
+  // Hold the FPGA in reset and read `length` bytes of flash from `addr`,
+  // passing them to `sink`. A length of zero reads to the end of the flash.
+  std::future<void> read(uint32_t addr, uint32_t length,
+                         const Options &options, ReadCallback sink,
+                         ProgressCallback progress = nullptr);
+
+  // Measure the USB link and the flash's erase and program times, and work
+  // out the tuning that suits them. Uses the 64k block at `scratch_addr` for
+  // the flash measurements; its contents are read out first and restored
+  // afterwards. Any saved profile is ignored while measuring.
+  std::future<Tuning> characterize(const Options &options,
+                                   uint32_t scratch_addr = scratch_at_end);
+
+private:
+  // A range of flash to program, [start, end)
+  struct Span {
+    uint32_t start;
+    uint64_t end;
+  };
+
+  void log(const char *format, ...) __attribute__((format(printf, 2, 3)));
+  void report(const ProgressCallback &progress, Progress::Stage stage,
+              uint64_t done, uint64_t total);
+
+  // Undoes whatever begin_operation set up when it goes out of scope, so that
+  // a failed operation never leaves the FPGA held in reset, the bus taken or
+  // completion events enabled. Does nothing after a clean end_operation.
+  class OperationGuard {
+  public:
+    explicit OperationGuard(Programmer *programmer) : _programmer(programmer) {}
+    ~OperationGuard() { _programmer->abandon_operation(); }
+    OperationGuard(const OperationGuard &) = delete;
+    OperationGuard &operator=(const OperationGuard &) = delete;
+
+  private:
+    Programmer *_programmer;
+  };
+
+  // `programming` says the image at options._file_lma is about to be erased
+  // and programmed, so the flash there can be written to in the meantime
+  void begin_operation(const Options &options, bool programming = false);
+  void end_operation();
+  void abandon_operation();
+  void hold_fpga();
+  void release_fpga();
+  void acquire_bus();
+  void release_bus();
+  void reboot_fpga();
+  void identify_flash(const Options &options);
+  void tune_spi_link(const Options &options, bool programming);
+  void load_tuning_profile(const Options &options);
+  void apply_tuning();
+  uint32_t wait_flash_idle(uint32_t typ_us, uint32_t max_us,
+                           const char *action, uint32_t addr);
+  void erase(const FlashParts::EraseOp &op);
+  void program_range(uint32_t addr, const uint8_t *data, uint32_t size,
+                     uint32_t chunk, const ProgressCallback &progress);
+  void verify_range(uint32_t addr, const uint8_t *expected, uint32_t size,
+                    const ProgressCallback &progress);
+  std::vector<Span> find_changed_spans(const BitstreamFile &image,
+                                       uint32_t start,
+                                       const ProgressCallback &progress);
+  void wait_sector_job(uint8_t slot, uint32_t addr, uint32_t typ_us,
+                       uint32_t max_us);
+
+  std::unique_ptr<BitstreamFile> patch_image(const BitstreamFile &base,
+                                             const Options &options);
+  void run_program(const BitstreamFile &base, const Options &options,
+                   const ProgressCallback &progress);
+  void run_program_live(const BitstreamFile &base, const Options &options,
+                        const ProgressCallback &progress);
+  void write_boot_sector(std::vector<uint8_t> sector, const Options &options);
+  void run_program_sector_jobs(const BitstreamFile &image,
+                               const std::vector<Span> &spans,
+                               const Options &options,
+                               const ProgressCallback &progress);
+  void run_read(uint32_t addr, uint32_t length, const Options &options,
+                const ReadCallback &sink, const ProgressCallback &progress);
+  Tuning run_characterize(uint32_t scratch_addr);
+  uint32_t characterize_link(const std::vector<uint8_t> &reference,
+                             uint32_t scratch_addr, Tuning *tuning);
+  void characterize_flash(uint32_t scratch_addr, uint32_t rtt_us,
+                          Tuning *tuning);
+  void restore_region(uint32_t addr, const std::vector<uint8_t> &data);
+
+private:
+  libusb_context *_usb_context;
+  libusb_device_handle *_usb_handle;
+  int _usb_interface;
+  std::string _serial;
+  UsbProto::Session _session;
+  FlashParts::FlashPart _part;
+  Tuning _tuning;
+  // UsbProto::FeatureFlags supported by the programmer firmware
+  uint32_t _features = 0;
+  // What the current operation has taken control of: the FPGA held in
+  // reset, or the SPI bus shared with a running FPGA
+  bool _fpga_held = false;
+  bool _bus_held = false;
+  LogCallback _log;
+  // Held for the duration of each operation
+  std::mutex _operation_mutex;
+};
+
+} // namespace Faff
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace FlashParts {
+
+// A single erase granularity that a part supports, and how long it takes.
+struct EraseType {
+  // Size in bytes. Zero if this slot is unused.
+  uint32_t size;
+  // Typical / worst case erase time in milliseconds
+  uint32_t typ_ms;
+  uint32_t max_ms;
+};
+
+// Erase granularities we have programmer opcodes for
+enum EraseSize : uint32_t {
+  ERASE_4K = 4 * 1024,
+  ERASE_32K = 32 * 1024,
+  ERASE_64K = 64 * 1024,
+};
+
+static const unsigned max_erase_types = 3;
+
+// SPI data widths a part can read with. Bit positions line up with
+// UsbProto::SpiIoMode.
+enum IoModeFlags : uint8_t {
+  IO_SINGLE = (1 << 0),
+  IO_DUAL = (1 << 1),
+  IO_QUAD = (1 << 2),
+};
+
+struct FlashPart {
+  std::string name;
+  // Manufacturer / device ID as returned by the identify command
+  uint8_t mfgr;
+  uint8_t device;
+  // Total size in bytes. Zero if unknown.
+  uint32_t capacity;
+  // Program page size in bytes. Writes must not cross a page boundary.
+  uint32_t page_size;
+  // Supported erase types, smallest first
+  EraseType erase_types[max_erase_types];
+  // Typical / worst case time to program a full page, in microseconds
+  uint32_t page_program_typ_us;
+  uint32_t page_program_max_us;
+  // Fastest SPI clock the part can read at, in kHz
+  uint32_t max_read_khz;
+  // Supported read data widths, as IoModeFlags
+  uint8_t io_modes;
+
+  // Look up the erase type for a given size. Returns nullptr if the part
+  // doesn't support erasing at that granularity.
+  const EraseType *erase_type(uint32_t size) const;
+  // Smallest erase granularity this part supports
+  uint32_t min_erase_size() const;
+  // Short, human readable description of the part
+  std::string description() const;
+};
+
+// Find a part in the built in table. Returns false if the ID pair isn't known.
+bool lookup(uint8_t mfgr, uint8_t device, FlashPart *out_part);
+
+// Conservative description of an unknown part, using the capacity encoding
+// that most SPI NOR families use for their device ID.
+FlashPart generic(uint8_t mfgr, uint8_t device);
+
+// Overlay the geometry and timing from a raw SFDP dump onto `part`.
+// `sfdp` is the SFDP address space starting at 0. Returns false if the data
+// doesn't contain a usable basic flash parameter table, in which case `part`
+// is not modified.
+bool apply_sfdp(const std::vector<uint8_t> &sfdp, FlashPart *part);
+
+// A single erase command in an erase plan
+struct EraseOp {
+  uint32_t addr;
+  const EraseType *type;
+};
+
+// Work out the smallest set of erase commands that clears every minimum size
+// sector touched by [start, end), without erasing anything outside those
+// sectors.
+std::vector<EraseOp> plan_erase(const FlashPart &part, uint32_t start,
+                                uint32_t end);
+
+} // namespace FlashParts
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// iCE40 multiboot header, as written by icemulti. It sits at the start of the
+// flash and holds five 32 byte entries, each pointing at an image: entry 0 is
+// booted at power on or when CRESET is released, and entries 1-4 are the
+// targets for SB_WARMBOOT with S1:S0 = 0-3.
+namespace Multiboot {
+
+static const unsigned entry_count = 5;
+static const unsigned entry_size = 32;
+static const unsigned header_size = entry_count * entry_size;
+
+// Entry booted at power on / reset
+static const unsigned power_on_entry = 0;
+
+// Read the image address from every entry. Returns false if `data` doesn't
+// start with a multiboot header.
+bool parse(const uint8_t *data, size_t size, uint32_t out_addrs[entry_count]);
+
+// Point entry `index` at `addr`, leaving everything else in the header as it
+// is. The header must already have parsed successfully.
+void set_entry(uint8_t *data, unsigned index, uint32_t addr);
+
+} // namespace Multiboot
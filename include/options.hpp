@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <patch.hpp>
+
+namespace Faff {
+
+// Settings shared by the library and the command line front end: which
+// programmer to talk to, and how to drive the flash behind it.
+struct Options {
+  // Default VID:PID values are a test value from
+  // http://pid.codes/pids/
+  int _usb_vid = 0x1209;
+  int _usb_pid = 0x0001;
+  // The firmware this tool was designed to work with happens to have
+  // this as the interface number.
+  int _usb_interface = 2;
+
+  // Serial selection. If a serial number is specified, only bind to a device
+  // with that serial. If no serial is specified, bind to any device that has
+  // the right vid:pid
+  bool _usb_serial_specified = false;
+  std::string _usb_serial = "";
+
+  // Transmit / receive endpoint numbers for the device.
+  int _usb_endpoint_tx = 0x02;
+  int _usb_endpoint_rx = 0x84;
+  // Interrupt endpoint the programmer sends completion events on
+  int _usb_endpoint_event = 0x83;
+
+  // Load address of the file.
+  // Defaults to the beginning of the flash.
+  unsigned _file_lma = 0x0;
+
+  // Should we read-back the programmed data to verify it
+  bool _verify_programmed = true;
+
+  // Per-board data to stamp over the image when programming
+  std::vector<Patch> _patches;
+
+  // Read back the flash first, and only program the sectors that differ from
+  // the image
+  bool _skip_unchanged = false;
+
+  // Read the flash's SFDP tables to refine the built in part parameters
+  bool _query_sfdp = false;
+
+  // Should we try to raise the SPI clock / bus width above the programmer
+  // default, and if so, an optional upper limit on the clock in kHz
+  bool _spi_tune = true;
+  unsigned _spi_max_khz = 0;
+
+  // Hand whole sectors to the programmer to erase, program and verify on its
+  // own, if the firmware supports it
+  bool _sector_jobs = true;
+
+  // Wait for the programmer to tell us when flash operations finish, rather
+  // than polling the busy flag, if the firmware supports it
+  bool _completion_events = true;
+
+  // Load the tuning profile saved by --characterize for this programmer, if
+  // there is one
+  bool _tuning_profile = true;
+
+  // Leave the FPGA running and share the SPI bus with it, rather than holding
+  // it in reset. When programming, _file_lma must be an inactive image slot of
+  // a multiboot flash, and the boot header is switched over to it once the
+  // image there has been verified.
+  bool _live = false;
+  // After a live update, reset the FPGA so that it boots the new image
+  bool _live_reboot = false;
+};
+
+} // namespace Faff
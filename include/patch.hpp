@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Per-board data stamped over a shared base image at program time, so that
+// one image file serves every board. Patch values may refer to variables as
+// ${name}; the programmer provides ${serial}, its USB serial number.
+namespace Faff {
+
+struct Patch {
+  enum class Encoding {
+    // Hex digits, two per byte. Spaces and colons are ignored, so MAC
+    // addresses can be written as they usually are.
+    HEX,
+    // The value's characters as they are, with no terminator
+    TEXT,
+    // The contents of the file the value names
+    FILE,
+  };
+
+  // Offset from the start of the image. Patches may extend past the end of
+  // the image, in which case the gap is left erased.
+  uint32_t offset;
+  Encoding encoding;
+  std::string value;
+};
+
+using PatchVariables = std::map<std::string, std::string>;
+
+// Parse "<offset>:<hex|text|file>:<value>". Throws Faff::Error if malformed.
+Patch parse_patch(const std::string &spec);
+
+// Read patches from a file with one "<offset> <encoding> <value>" per line.
+// Blank lines and lines starting with # are skipped. Throws Faff::Error.
+std::vector<Patch> load_patches(const char *path);
+
+// Replace each ${name} in `text`. Throws Faff::Error for unknown variables.
+std::string substitute(const std::string &text,
+                       const PatchVariables &variables);
+
+// The bytes `patch` writes, after substitution
+std::vector<uint8_t> patch_bytes(const Patch &patch,
+                                 const PatchVariables &variables);
+
+} // namespace Faff
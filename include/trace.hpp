@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Binary log of every USB transfer a UsbProto::Session makes, for working out
+// afterwards where the time went on a slow run.
+//
+// A trace file is a header of [8 byte magic, big endian u64 wall clock start
+// time in ns since the unix epoch], followed by fixed size records. All
+// record fields are big endian, matching the wire protocol.
+namespace Trace {
+
+static const char file_magic[8] = {'F', 'A', 'F', 'F', 'T', 'R', 'C', 1};
+static const size_t header_size = 16;
+static const size_t record_size = 36;
+
+enum class Kind : uint8_t {
+  // Host to programmer transfer. Opcode and address are parsed out of the
+  // command header.
+  COMMAND = 0,
+  // Programmer to host transfer, attributed to the last command sent
+  RESPONSE = 1,
+  // Completion event. Has no duration, opcode is the UsbProto::EventType.
+  EVENT = 2,
+};
+
+struct Record {
+  // Start of the transfer relative to the start of the trace, and how long
+  // libusb took to complete it
+  uint64_t start_ns;
+  uint32_t duration_ns;
+  Kind kind;
+  uint8_t endpoint;
+  uint8_t opcode;
+  // UsbProto::SectorJobState, for sector job events
+  uint8_t status;
+  // libusb return code
+  int32_t result;
+  uint32_t addr;
+  // Requested and actual transfer sizes in bytes
+  uint32_t length;
+  uint32_t transferred;
+  uint32_t timeout_ms;
+
+  uint64_t end_ns() const { return start_ns + duration_ns; }
+};
+
+class Writer {
+public:
+  // Throws Faff::Error if the file can't be created
+  explicit Writer(const char *path);
+  ~Writer();
+  Writer(const Writer &) = delete;
+  Writer &operator=(const Writer &) = delete;
+
+  // Nanoseconds since the trace was opened
+  uint64_t now_ns() const;
+
+  // Safe to call from any thread. Write errors are held until close(), so
+  // a full disk doesn't abort a half finished programming run.
+  void write(const Record &record);
+
+  // Flush the file. Throws Faff::Error if any write failed.
+  void close();
+
+private:
+  FILE *_file = nullptr;
+  std::chrono::steady_clock::time_point _start;
+  std::mutex _mutex;
+  bool _failed = false;
+};
+
+struct File {
+  uint64_t start_unix_ns;
+  std::vector<Record> records;
+};
+
+// Throws Faff::Error if the file can't be read or isn't a trace
+File read(const char *path);
+
+} // namespace Trace
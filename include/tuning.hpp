@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Per-board link and flash parameters, measured by `faff --characterize` and
+// saved as a profile keyed on the programmer serial. The defaults are what
+// faff used before it could measure them, and are what you get without a
+// profile.
+namespace Faff {
+
+struct Tuning {
+  // USB timeouts. Bulk transfers get the per KiB allowance on top of the
+  // command timeout.
+  unsigned command_timeout_ms = 100;
+  unsigned bulk_timeout_us_per_kib = 1000;
+
+  // Minimum time between flash status polls. Polling faster than the link
+  // round trip only queues up more USB traffic.
+  unsigned poll_interval_us = 100;
+
+  // Bytes per FLASH_WRITE when the host drives programming. The default is
+  // the largest power of two that fits in a packet with the command header.
+  unsigned write_chunk = 32;
+  // Bytes per FLASH_READ_BULK for verify and read-out
+  unsigned read_block = 64 * 1024;
+
+  // Measured typical flash timings, used in place of the part table's when
+  // the same flash part is found. Zero means not measured.
+  uint8_t flash_mfgr = 0;
+  uint8_t flash_device = 0;
+  unsigned erase_4k_ms = 0;
+  unsigned erase_32k_ms = 0;
+  unsigned erase_64k_ms = 0;
+  unsigned page_program_us = 0;
+};
+
+// Where the profile for the programmer with `serial` lives:
+// $XDG_CONFIG_HOME/faff/<serial>.conf, falling back to ~/.config. Empty if
+// there's no serial or no home directory to put it in.
+std::string tuning_profile_path(const std::string &serial);
+
+// Returns false if there is no profile at `path`. Unknown keys are skipped,
+// so that older versions can read newer profiles, and listed in
+// out_unknown_keys if given. Throws Faff::Error if the profile is malformed or
+// a value is out of the range faff can work with.
+bool load_tuning(const std::string &path, Tuning *out_tuning,
+                 std::vector<std::string> *out_unknown_keys = nullptr);
+
+// Write a profile, creating its directory if needed. Throws Faff::Error on
+// failure.
+void save_tuning(const std::string &path, const Tuning &tuning,
+                 const std::string &comment);
+
+} // namespace Faff
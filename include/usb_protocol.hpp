@@ -3,7 +3,14 @@
 #include <libusb.h>
 #include <stdint.h>
 
-#include <cmdline.hpp>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <options.hpp>
+#include <trace.hpp>
 
 namespace UsbProto {
 
@@ -11,6 +18,8 @@ enum class Opcode : uint8_t {
   // General
   NOP = 0x00,
   SET_RGB_LED = 0x01,
+  QUERY_FEATURES = 0x02,
+  EVENTS_ENABLE = 0x03,
   // FPGA interface
   FPGA_RESET_ASSERT = 0x10,
   FPGA_RESET_DEASSERT = 0x11,
@@ -24,6 +33,30 @@ enum class Opcode : uint8_t {
   FLASH_WRITE = 0x25,
   FLASH_READ = 0x26,
   FLASH_QUERY_STATUS = 0x27,
+  FLASH_READ_BULK = 0x28,
+  FLASH_READ_SFDP = 0x29,
+  // SPI link configuration
+  SPI_QUERY_CONFIG = 0x30,
+  SPI_SET_CONFIG = 0x31,
+  // Device side sector jobs
+  SECTOR_JOB_LOAD = 0x40,
+  SECTOR_JOB_COMMIT = 0x41,
+  SECTOR_JOB_STATUS = 0x42,
+  // Shared SPI bus arbitration, for programming while the FPGA runs
+  SPI_BUS_ACQUIRE = 0x50,
+  SPI_BUS_RELEASE = 0x51,
+};
+
+// Name of an Opcode, for logs and traces
+const char *opcode_name(uint8_t opcode);
+
+// Optional firmware features, as reported by QUERY_FEATURES
+enum class FeatureFlags : uint32_t {
+  FEATURE_SECTOR_JOBS = (1 << 0),
+  FEATURE_COMPLETION_EVENTS = (1 << 1),
+  // The programmer can share the flash's SPI bus with a running FPGA, via
+  // SPI_BUS_ACQUIRE / SPI_BUS_RELEASE
+  FEATURE_LIVE_PROGRAMMING = (1 << 2),
 };
 
 enum class FpgaStatusFlags : uint8_t {
@@ -34,13 +67,92 @@ enum class FlashStatusFlash : uint8_t {
   FLAG_FLASH_BUSY = (1 << 0),
 };
 
+// Largest FLASH_WRITE payload: one full speed packet, less the command header
+static const uint8_t max_write_size = 64 - 6;
+
+// Data width used for flash reads. Writes and commands always go out on a
+// single data line.
+enum class SpiIoMode : uint8_t {
+  SINGLE = 0,
+  DUAL = 1,
+  QUAD = 2,
+};
+
+struct SpiConfig {
+  // Bitmask of (1 << SpiIoMode) for the modes the programmer can drive
+  uint8_t io_modes;
+  // Clock frequencies the programmer can generate, in kHz. Indices into this
+  // list are used to select a frequency.
+  std::vector<uint32_t> frequencies_khz;
+  // Currently selected frequency index and mode
+  uint8_t frequency_index;
+  SpiIoMode io_mode;
+};
+
+// A sector job has the programmer erase, program and verify one flash sector
+// from its own RAM, so the host only needs one round trip per sector. There
+// are two job slots, so that one can be uploaded while the other runs.
+static const unsigned sector_job_slots = 2;
+static const uint32_t sector_job_size = 4096;
+
+enum class SectorJobFlags : uint8_t {
+  // Erase the sector before programming it
+  JOB_ERASE = (1 << 0),
+  // Read the sector back and compare it against the job buffer
+  JOB_VERIFY = (1 << 1),
+};
+
+enum class SectorJobState : uint8_t {
+  IDLE = 0x00,
+  QUEUED = 0x01,
+  BUSY = 0x02,
+  DONE = 0x03,
+  // Uploaded data didn't match the CRC sent with the commit
+  ERR_CRC = 0x80,
+  // Readback didn't match the job buffer
+  ERR_VERIFY = 0x81,
+  // Flash never reported idle
+  ERR_TIMEOUT = 0x82,
+};
+
+// Once enabled, the programmer sends one of these on the event endpoint each
+// time a flash operation finishes, so the host doesn't need to poll.
+enum class EventType : uint8_t {
+  // An erase or write has finished and the flash is idle again
+  FLASH_IDLE = 0x01,
+  // A sector job has finished, successfully or otherwise
+  SECTOR_JOB_DONE = 0x02,
+};
+
+// Event packet layout is [type, slot, status, big endian u32 address]
+struct Event {
+  EventType type;
+  // Sector job slot, for SECTOR_JOB_DONE
+  uint8_t slot;
+  // SectorJobState, for SECTOR_JOB_DONE
+  uint8_t status;
+  // Address the finished operation was issued for
+  uint32_t addr;
+};
+
 class Session {
 public:
-  Session(libusb_device_handle *usb_handle, CliArgs &args)
-      : _usb_handle(usb_handle), _args(args) {}
+  Session(libusb_device_handle *usb_handle, const Faff::Options &options)
+      : _usb_handle(usb_handle), _options(options) {}
+  ~Session();
+  Session(const Session &) = delete;
+  Session &operator=(const Session &) = delete;
+
+  // Stop using the device handle, ahead of it being closed. Any pending event
+  // transfer is cancelled without telling the firmware, since the device may
+  // be why we are closing.
+  void close();
 
   // General
   void cmd_set_rgb_led(uint8_t r, uint8_t g, uint8_t b);
+  // Bitmask of FeatureFlags. Firmware that predates this command reports no
+  // features.
+  uint32_t cmd_query_features();
 
   // FPGA
   void cmd_fpga_reset_assert();
@@ -57,14 +169,85 @@ public:
   void cmd_flash_erase_chip();
   void cmd_flash_write(uint32_t addr, const uint8_t *data, uint8_t size);
   void cmd_flash_read(uint32_t addr, uint8_t *out_data, uint8_t size);
+  // Streamed read. The device responds with `size` bytes split across as many
+  // max-size IN packets as needed, so there is only one command round trip
+  // per call regardless of the size.
+  void cmd_flash_read_bulk(uint32_t addr, uint8_t *out_data, uint32_t size);
+  // Read from the flash's SFDP (JESD216) parameter space
+  void cmd_flash_read_sfdp(uint32_t addr, uint8_t *out_data, uint8_t size);
   void cmd_flash_query_status(uint8_t *out_status);
   bool flash_busy();
 
+  // SPI link. Older programmer firmware doesn't implement these, in which case
+  // the query returns false and the link stays at the firmware default.
+  bool cmd_spi_query_config(SpiConfig *out_config);
+  bool cmd_spi_set_config(uint8_t frequency_index, SpiIoMode mode);
+
+  // Sector jobs
+  void cmd_sector_job_load(uint8_t slot, const uint8_t *data, uint16_t size);
+  void cmd_sector_job_commit(uint8_t slot, uint32_t addr, uint32_t crc,
+                             uint8_t flags);
+  void cmd_sector_job_status(SectorJobState *out_states);
+
+  // Shared SPI bus. Acquiring waits for any flash access the running FPGA
+  // design is making to finish, then has the programmer drive the bus until
+  // it is released. Returns false if the programmer couldn't get the bus.
+  bool cmd_spi_bus_acquire();
+  void cmd_spi_bus_release();
+
+  // Completion events. Enabling them keeps a transfer pending on the event
+  // endpoint, serviced by libusb's event handling on `usb_context`.
+  void enable_completion_events(libusb_context *usb_context);
+  void disable_completion_events();
+  bool completion_events_enabled() const { return _event_transfer != nullptr; }
+  // Block in libusb's event handling until an event of `type` for `addr`
+  // arrives. Returns false if the deadline passes first.
+  bool wait_event(EventType type, uint32_t addr,
+                  std::chrono::steady_clock::time_point deadline,
+                  Event *out_event);
+
+  // Timeout for command and short response transfers, and the extra time
+  // allowed per KiB for bulk transfers. USB full speed tops out at a little
+  // over 1MB/s, hence the default of 1ms per KiB.
+  void set_timeouts(unsigned command_timeout_ms,
+                    unsigned bulk_timeout_us_per_kib);
+
+  // Record every transfer from here on to `trace`. Pass nullptr to stop.
+  void set_trace(std::shared_ptr<Trace::Writer> trace) { _trace = trace; }
+
 private:
+  // libusb_bulk_transfer, plus a trace record if tracing is on
+  int bulk_transfer(uint8_t endpoint, uint8_t *data, int length,
+                    int *transferred, unsigned timeout_ms);
+  unsigned bulk_timeout_ms(uint32_t size) const;
+  // Throws a Faff::Error describing `action` if `code` is a libusb error
   void assert_libusb_ok(int code, const char *action);
+  void cmd_events_enable(bool enable);
+  static void LIBUSB_CALL event_transfer_callback(libusb_transfer *transfer);
+  void cancel_event_transfer();
 
 private:
   libusb_device_handle *_usb_handle;
-  CliArgs _args;
+  Faff::Options _options;
+  unsigned _command_timeout_ms = 100;
+  unsigned _bulk_timeout_us_per_kib = 1000;
+  // Commands that wait on something outside the programmer, such as the
+  // running FPGA design letting go of the bus, get a fixed timeout. The tuned
+  // one only covers the link.
+  static const unsigned blocking_timeout_ms = 1000;
+
+  // Event endpoint state. The transfer callback may run on any thread that is
+  // handling events for the context, so the queue is locked.
+  libusb_context *_usb_context = nullptr;
+  libusb_transfer *_event_transfer = nullptr;
+  uint8_t _event_buffer[8];
+  bool _event_transfer_active = false;
+  std::mutex _event_mutex;
+  std::deque<Event> _events;
+
+  std::shared_ptr<Trace::Writer> _trace;
+  // Last command sent, which the next response is attributed to
+  uint8_t _trace_opcode = 0;
+  uint32_t _trace_addr = 0;
 };
 } // namespace UsbProto
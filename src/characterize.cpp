@@ -0,0 +1,300 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include <checksum.hpp>
+#include <faff.hpp>
+
+// Programmer::characterize: measure the link and the flash on the attached
+// board, and turn the measurements into a Tuning.
+
+namespace Faff {
+
+static const uint32_t scratch_size = 64 * 1024;
+
+static uint32_t elapsed_us(std::chrono::steady_clock::time_point since) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - since)
+      .count();
+}
+
+static uint32_t median(std::vector<uint32_t> samples) {
+  std::sort(samples.begin(), samples.end());
+  return samples[samples.size() / 2];
+}
+
+static double kib_per_s(uint64_t bytes, uint32_t us) {
+  return us > 0 ? (bytes / 1024.0) / (us / 1e6) : 0.0;
+}
+
+// Something other than all ones, so that every write actually programs bits
+static void fill_pattern(uint8_t *data, size_t size, uint32_t seed) {
+  uint32_t state = seed * 2654435761u + 1;
+  for (size_t i = 0; i < size; i++) {
+    state = state * 1664525u + 1013904223u;
+    data[i] = state >> 24;
+  }
+}
+
+Tuning Programmer::run_characterize(uint32_t scratch_addr) {
+  if (scratch_addr == scratch_at_end) {
+    if (_part.capacity < scratch_size) {
+      throw Error("Flash size unknown, please specify a scratch address");
+    }
+    scratch_addr = _part.capacity - scratch_size;
+  }
+  if (scratch_addr % scratch_size != 0 ||
+      (_part.capacity != 0 &&
+       (uint64_t)scratch_addr + scratch_size > _part.capacity)) {
+    char message[128];
+    snprintf(message, sizeof(message),
+             "Scratch address 0x%08" PRIx32
+             " is not a 64k block inside the flash",
+             scratch_addr);
+    throw Error(message);
+  }
+
+  Tuning tuning;
+  tuning.flash_mfgr = _part.mfgr;
+  tuning.flash_device = _part.device;
+
+  // Reading is harmless, so measure that against the region's current
+  // contents, which we need to keep anyway
+  std::vector<uint8_t> original(scratch_size);
+  _session.cmd_flash_read_bulk(scratch_addr, original.data(), scratch_size);
+  const uint32_t rtt_us = characterize_link(original, scratch_addr, &tuning);
+
+  log("Using 0x%08" PRIx32 "-0x%08" PRIx32
+      " as scratch space, it will be restored afterwards",
+      scratch_addr, scratch_addr + scratch_size - 1);
+  try {
+    characterize_flash(scratch_addr, rtt_us, &tuning);
+  } catch (const Error &) {
+    log("Characterization failed, restoring scratch region");
+    restore_region(scratch_addr, original);
+    throw;
+  }
+  restore_region(scratch_addr, original);
+
+  return tuning;
+}
+
+// Round trip time, and bulk read throughput at each block size. Returns the
+// median round trip in microseconds.
+uint32_t Programmer::characterize_link(const std::vector<uint8_t> &reference,
+                                       uint32_t scratch_addr, Tuning *tuning) {
+  // A status query is the smallest command that gets a response, so it
+  // stands in for a NOP round trip. It's also exactly what polling costs.
+  const unsigned round_trips = 200;
+  std::vector<uint32_t> rtt_us;
+  for (unsigned i = 0; i < round_trips; i++) {
+    const auto start = std::chrono::steady_clock::now();
+    _session.flash_busy();
+    rtt_us.push_back(elapsed_us(start));
+  }
+  const uint32_t rtt_median_us = median(rtt_us);
+  const uint32_t rtt_worst_us = *std::max_element(rtt_us.begin(), rtt_us.end());
+  log("Status round trip: median %" PRIu32 "us, worst %" PRIu32 "us",
+      rtt_median_us, rtt_worst_us);
+
+  // Generous headroom over the worst round trip we saw, but no shorter than
+  // a scheduler hiccup on a busy host
+  tuning->command_timeout_ms =
+      std::min(2000u, std::max(50u, (rtt_worst_us * 10 + 999) / 1000));
+  tuning->poll_interval_us = std::max(50u, rtt_median_us);
+
+  const uint32_t read_blocks[] = {4 * 1024, 16 * 1024, 64 * 1024};
+  std::vector<uint8_t> readback(scratch_size);
+  double best_kib_s = 0;
+  for (uint32_t block : read_blocks) {
+    // Best of a few passes, to see past anything else the host was doing
+    uint32_t best_us = UINT32_MAX;
+    for (int pass = 0; pass < 3; pass++) {
+      const auto start = std::chrono::steady_clock::now();
+      for (uint32_t offset = 0; offset < scratch_size; offset += block) {
+        _session.cmd_flash_read_bulk(scratch_addr + offset, &readback[offset],
+                                     block);
+      }
+      best_us = std::min(best_us, elapsed_us(start));
+      if (readback != reference) {
+        throw Error("Read back of scratch region was inconsistent");
+      }
+    }
+    const double rate = kib_per_s(scratch_size, best_us);
+    log("FLASH_READ_BULK, %6" PRIu32 " byte blocks: %8.1f KiB/s", block, rate);
+    if (rate > best_kib_s) {
+      best_kib_s = rate;
+      tuning->read_block = block;
+    }
+  }
+
+  // Allow twice the measured time per KiB on top of the command timeout
+  if (best_kib_s > 0) {
+    tuning->bulk_timeout_us_per_kib =
+        std::max(250u, (unsigned)(2 * 1e6 / best_kib_s));
+  }
+  return rtt_median_us;
+}
+
+// Erase and program timings, and write throughput at each chunk size. Layout
+// of the scratch block: sector 0 for page program timing, sectors 1-4 for the
+// chunk size sweep, sectors 8-10 for 4k erase timing.
+void Programmer::characterize_flash(uint32_t scratch_addr, uint32_t rtt_us,
+                                    Tuning *tuning) {
+  const uint32_t sector_size = 4096;
+  const FlashParts::EraseType *erase_4k =
+      _part.erase_type(FlashParts::ERASE_4K);
+  const FlashParts::EraseType *erase_32k =
+      _part.erase_type(FlashParts::ERASE_32K);
+  const FlashParts::EraseType *erase_64k =
+      _part.erase_type(FlashParts::ERASE_64K);
+
+  // Start from a clean block. The region still holds real data at this
+  // point, which is what a 64k erase normally faces.
+  if (erase_64k != nullptr) {
+    erase(FlashParts::EraseOp{scratch_addr, erase_64k});
+    tuning->erase_64k_ms =
+        (wait_flash_idle(0, erase_64k->max_ms * 1000, "erase", scratch_addr) +
+         999) /
+        1000;
+  } else {
+    for (const FlashParts::EraseOp &op : FlashParts::plan_erase(
+             _part, scratch_addr, scratch_addr + scratch_size)) {
+      erase(op);
+      wait_flash_idle(op.type->typ_ms * 1000, op.type->max_ms * 1000, "erase",
+                      op.addr);
+    }
+  }
+
+  std::vector<uint8_t> pattern(sector_size);
+  std::vector<uint8_t> readback(sector_size);
+
+  // Page program time, from full page writes in sector 0. Each write
+  // command costs about one round trip on top of the flash's own time (the
+  // command going out, and the poll or event that reports it done), so take
+  // that back off. Polling starts straight away, rather than after the part
+  // table's typical time, so that the table can't set a floor.
+  const uint32_t timing_chunk = UsbProto::max_write_size;
+  const uint32_t writes_per_page =
+      (_part.page_size + timing_chunk - 1) / timing_chunk;
+  const uint32_t table_program_us = _part.page_program_typ_us;
+  std::vector<uint32_t> program_us;
+  fill_pattern(pattern.data(), sector_size, 0);
+  _part.page_program_typ_us = 0;
+  for (uint32_t offset = 0; offset < sector_size; offset += _part.page_size) {
+    const auto start = std::chrono::steady_clock::now();
+    program_range(scratch_addr + offset, &pattern[offset], _part.page_size,
+                  timing_chunk, nullptr);
+    program_us.push_back(elapsed_us(start));
+  }
+  _part.page_program_typ_us = table_program_us;
+  const uint32_t page_total_us = median(program_us);
+  const uint32_t overhead_us = writes_per_page * rtt_us;
+  if (page_total_us > overhead_us) {
+    tuning->page_program_us = page_total_us - overhead_us;
+    log("Page program: %uus (part table typical %" PRIu32 "us)",
+        tuning->page_program_us, _part.page_program_typ_us);
+  } else {
+    tuning->page_program_us = 0;
+    log("Page program: hidden by USB latency, keeping the part table's "
+        "%" PRIu32 "us",
+        _part.page_program_typ_us);
+  }
+
+  // Write throughput per chunk size. Each size gets its own sector, and must
+  // read back correctly to count.
+  const uint32_t write_chunks[] = {8, 16, 32, UsbProto::max_write_size};
+  double best_kib_s = 0;
+  uint32_t sector_addr = scratch_addr + sector_size;
+  for (uint32_t chunk : write_chunks) {
+    fill_pattern(pattern.data(), sector_size, chunk);
+    const auto start = std::chrono::steady_clock::now();
+    program_range(sector_addr, pattern.data(), sector_size, chunk, nullptr);
+    const double rate = kib_per_s(sector_size, elapsed_us(start));
+    _session.cmd_flash_read_bulk(sector_addr, readback.data(), sector_size);
+    if (readback != pattern) {
+      log("FLASH_WRITE, %2" PRIu32 " byte chunks: failed verify", chunk);
+    } else {
+      log("FLASH_WRITE, %2" PRIu32 " byte chunks: %8.1f KiB/s", chunk, rate);
+      if (rate > best_kib_s) {
+        best_kib_s = rate;
+        tuning->write_chunk = chunk;
+      }
+    }
+    sector_addr += sector_size;
+  }
+
+  // 32k erase, over the first half of the block which we've just filled
+  // with data
+  if (erase_32k != nullptr) {
+    erase(FlashParts::EraseOp{scratch_addr, erase_32k});
+    tuning->erase_32k_ms =
+        (wait_flash_idle(0, erase_32k->max_ms * 1000, "erase", scratch_addr) +
+         999) /
+        1000;
+  }
+
+  // 4k erases, each over a sector we've just programmed
+  if (erase_4k != nullptr) {
+    std::vector<uint32_t> erase_us;
+    for (uint32_t sector = 8; sector < 11; sector++) {
+      const uint32_t addr = scratch_addr + sector * sector_size;
+      fill_pattern(pattern.data(), sector_size, sector);
+      program_range(addr, pattern.data(), sector_size, tuning->write_chunk,
+                    nullptr);
+      erase(FlashParts::EraseOp{addr, erase_4k});
+      erase_us.push_back(
+          wait_flash_idle(0, erase_4k->max_ms * 1000, "erase", addr));
+    }
+    tuning->erase_4k_ms = (median(erase_us) + 999) / 1000;
+  }
+
+  const struct {
+    const char *name;
+    const FlashParts::EraseType *type;
+    unsigned measured_ms;
+  } erases[] = {
+      {"4k", erase_4k, tuning->erase_4k_ms},
+      {"32k", erase_32k, tuning->erase_32k_ms},
+      {"64k", erase_64k, tuning->erase_64k_ms},
+  };
+  for (const auto &measured : erases) {
+    if (measured.type != nullptr) {
+      log("%s erase: %ums (part table typical %" PRIu32 "ms)", measured.name,
+          measured.measured_ms, measured.type->typ_ms);
+    }
+  }
+}
+
+// Put back what was in the scratch block before we started
+void Programmer::restore_region(uint32_t addr,
+                                const std::vector<uint8_t> &data) {
+  for (const FlashParts::EraseOp &op :
+       FlashParts::plan_erase(_part, addr, addr + data.size())) {
+    erase(op);
+    wait_flash_idle(op.type->typ_ms * 1000, op.type->max_ms * 1000, "erase",
+                    op.addr);
+  }
+
+  // Only pages that had something in them need writing
+  for (uint32_t offset = 0; offset < data.size(); offset += _part.page_size) {
+    if (!Checksum::is_erased(&data[offset], _part.page_size)) {
+      program_range(addr + offset, &data[offset], _part.page_size,
+                    Tuning().write_chunk, nullptr);
+    }
+  }
+
+  std::vector<uint8_t> readback(data.size());
+  _session.cmd_flash_read_bulk(addr, readback.data(), data.size());
+  if (readback != data) {
+    char message[128];
+    snprintf(message, sizeof(message),
+             "Failed to restore scratch region at 0x%08" PRIx32, addr);
+    throw Error(message);
+  }
+}
+
+} // namespace Faff
@@ -0,0 +1,42 @@
+#include <checksum.hpp>
+
+namespace Checksum {
+
+static const uint32_t crc32_polynomial = 0xEDB8'8320;
+
+// Nibble lookup table. Small enough to stay in cache, and still several times
+// faster than the bitwise loop for the multi-megabyte images we see.
+struct Crc32Table {
+  Crc32Table() {
+    for (uint32_t i = 0; i < 16; i++) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 4; bit++) {
+        crc = (crc & 1) ? (crc >> 1) ^ crc32_polynomial : (crc >> 1);
+      }
+      _entries[i] = crc;
+    }
+  }
+
+  uint32_t _entries[16];
+};
+
+uint32_t crc32(const uint8_t *data, size_t size, uint32_t crc) {
+  static const Crc32Table table;
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= data[i];
+    crc = (crc >> 4) ^ table._entries[crc & 0xF];
+    crc = (crc >> 4) ^ table._entries[crc & 0xF];
+  }
+  return ~crc;
+}
+
+bool is_erased(const uint8_t *data, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    if (data[i] != 0xFF)
+      return false;
+  }
+  return true;
+}
+
+} // namespace Checksum
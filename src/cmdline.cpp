@@ -6,6 +6,7 @@
 #include <string>
 
 #include <cmdline.hpp>
+#include <error.hpp>
 
 static const char *getopt_optstring = "hf:e";
 static const struct option cmd_line_options[] = {
@@ -26,6 +27,51 @@ static const struct option cmd_line_options[] = {
     {.name = "no-verify", .has_arg = no_argument, .flag = nullptr, .val = 0},
     {.name = "help", .has_arg = no_argument, .flag = nullptr, .val = 0},
     {.name = "enumerate", .has_arg = no_argument, .flag = nullptr, .val = 0},
+    {.name = "read-out",
+     .has_arg = required_argument,
+     .flag = nullptr,
+     .val = 0},
+    {.name = "read-length",
+     .has_arg = required_argument,
+     .flag = nullptr,
+     .val = 0},
+    {.name = "sparse", .has_arg = no_argument, .flag = nullptr, .val = 0},
+    {.name = "sfdp", .has_arg = no_argument, .flag = nullptr, .val = 0},
+    {.name = "spi-max-khz",
+     .has_arg = required_argument,
+     .flag = nullptr,
+     .val = 0},
+    {.name = "no-spi-tune", .has_arg = no_argument, .flag = nullptr, .val = 0},
+    {.name = "no-sector-jobs",
+     .has_arg = no_argument,
+     .flag = nullptr,
+     .val = 0},
+    {.name = "no-events", .has_arg = no_argument, .flag = nullptr, .val = 0},
+    {.name = "manifest",
+     .has_arg = required_argument,
+     .flag = nullptr,
+     .val = 0},
+    {.name = "trace", .has_arg = required_argument, .flag = nullptr, .val = 0},
+    {.name = "characterize",
+     .has_arg = no_argument,
+     .flag = nullptr,
+     .val = 0},
+    {.name = "scratch",
+     .has_arg = required_argument,
+     .flag = nullptr,
+     .val = 0},
+    {.name = "no-profile", .has_arg = no_argument, .flag = nullptr, .val = 0},
+    {.name = "patch", .has_arg = required_argument, .flag = nullptr, .val = 0},
+    {.name = "patches",
+     .has_arg = required_argument,
+     .flag = nullptr,
+     .val = 0},
+    {.name = "skip-unchanged",
+     .has_arg = no_argument,
+     .flag = nullptr,
+     .val = 0},
+    {.name = "live", .has_arg = no_argument, .flag = nullptr, .val = 0},
+    {.name = "reboot", .has_arg = no_argument, .flag = nullptr, .val = 0},
     // Final value must be sentinel
     {0, 0, 0, 0},
 };
@@ -42,8 +88,58 @@ fprintf(stderr, "faff: Find and Flash FPGA\n"
 "    --lma <address>        The load memory address to use for the file.\n"
 "                           Defaults to 0x0000\n"
 "    --no-verify            Disable reading back the programmed file to\n"
-"                           verify that programming was successful."
-"\n"
+"                           verify that programming was successful.\n"
+"    --sfdp                 Read the flash's SFDP tables for geometry and\n"
+"                           timing, rather than relying on the built in\n"
+"                           part table\n"
+"    --spi-max-khz <khz>    Upper limit for the SPI clock. By default the\n"
+"                           fastest clock the flash supports is used\n"
+"    --no-spi-tune          Leave the SPI clock and bus width at the\n"
+"                           programmer's defaults\n"
+"    --no-sector-jobs       Drive every erase and page write from the host,\n"
+"                           even if the programmer can program whole\n"
+"                           sectors by itself\n"
+"    --no-events            Poll the flash busy flag rather than waiting for\n"
+"                           the programmer to report completion\n"
+"    --trace <file>         Record every USB transfer to <file>, for\n"
+"                           analysis with faff-trace\n"
+"    --no-profile           Ignore the tuning profile saved for this\n"
+"                           programmer by --characterize\n"
+"Per-board patching:\n"
+"    --patch <offset>:<encoding>:<value>\n"
+"                           Stamp <value> over the image at <offset> before\n"
+"                           programming. <encoding> is one of hex, text or\n"
+"                           file (a path to read the bytes from). ${serial}\n"
+"                           in <value> is replaced with the programmer's\n"
+"                           serial. May be given more than once\n"
+"    --patches <file>       Read patches from <file>, one\n"
+"                           '<offset> <encoding> <value>' per line\n"
+"    --skip-unchanged       Read back the flash first, and only program the\n"
+"                           sectors that differ from the (patched) image\n"
+"Live update:\n"
+"    --live                 Leave the FPGA running, with the programmer\n"
+"                           sharing the SPI bus with it. When programming,\n"
+"                           --lma must be an unused image slot of a\n"
+"                           multiboot flash; once the image there verifies,\n"
+"                           the boot header is switched over to it\n"
+"    --reboot               After a live update, reset the FPGA so that it\n"
+"                           boots the new image straight away\n"
+"Flash read-out:\n"
+"    --read-out <file>      Dump the flash contents to <file> instead of\n"
+"                           programming. Reading starts at --lma\n"
+"    --read-length <bytes>  Number of bytes to dump. Defaults to the rest of\n"
+"                           the flash, as sized from the chip's device ID\n"
+"    --sparse               Leave erased (all 0xFF) sectors as holes in the\n"
+"                           output file. Note that holes read back as 0x00\n"
+"    --manifest <file>      Write a CRC-32 for every 4k sector of the dump\n"
+"                           to <file>, for later comparison\n"
+"Characterization:\n"
+"    --characterize         Measure the USB link and flash timings on the\n"
+"                           attached board, and save a tuning profile that\n"
+"                           later runs with this programmer will use\n"
+"    --scratch <address>    64k block to use for erase / program timing. Its\n"
+"                           contents are restored afterwards. Defaults to\n"
+"                           the last 64k of the flash\n"
 "Target selection:\n"
 "    --usb-vid <vid>        Set vendor ID of device to use\n"
 "    --usb-pid <pid>        Set product ID of device to use\n"
@@ -54,13 +150,28 @@ fprintf(stderr, "faff: Find and Flash FPGA\n"
   /* clang-format on */
 }
 
+int CliArgs::modes_selected() {
+  return (_file_path != nullptr) + (_read_out_path != nullptr) +
+         _characterize;
+}
+
 bool CliArgs::valid() {
   // If we got any bad / missing arguments, we aren't valid
   if (_arguments_invalid)
     return false;
 
-  // If we didn't get a file specified then args are invalid
-  if (_file_path == nullptr)
+  // We need exactly one of a file to program, a file to dump to, or
+  // characterization
+  if (modes_selected() != 1)
+    return false;
+
+  // Rebooting only makes sense after switching to a new image
+  if (_live_reboot && (!_live || _file_path == nullptr))
+    return false;
+
+  // The library takes a zero length to mean the rest of the flash, which is
+  // what leaving the length out already does
+  if (_read_length_specified && _read_length == 0)
     return false;
 
   // If the USB vid/pid is out of range, args are invalid
@@ -78,8 +189,15 @@ void CliArgs::report_errors() {
     fprintf(stderr, "Unexpected arguments encountered\n");
 
   // If we didn't get a file specified then args are invalid
-  if (_file_path == nullptr)
+  if (modes_selected() == 0)
     fprintf(stderr, "No input file specified\n");
+  if (modes_selected() > 1)
+    fprintf(stderr, "Only one of --file, --read-out and --characterize can "
+                    "be used at once\n");
+  if (_live_reboot && (!_live || _file_path == nullptr))
+    fprintf(stderr, "--reboot needs --live and a file to program\n");
+  if (_read_length_specified && _read_length == 0)
+    fprintf(stderr, "--read-length must be greater than zero\n");
 
   // If the USB vid/pid is out of range, args are invalid
   if (_usb_vid < 0 || _usb_vid > 0xFFFF)
@@ -123,6 +241,49 @@ bool CliArgs::parse(int argc, char **argv) {
         _verify_programmed = false;
       } else if (!strcmp("enumerate", option_name)) {
         _enumerate_only = true;
+      } else if (!strcmp("read-out", option_name)) {
+        _read_out_path = optarg;
+      } else if (!strcmp("read-length", option_name)) {
+        _read_length_specified = true;
+        _read_length = std::stoul(optarg, nullptr, 0);
+      } else if (!strcmp("sparse", option_name)) {
+        _read_out_sparse = true;
+      } else if (!strcmp("sfdp", option_name)) {
+        _query_sfdp = true;
+      } else if (!strcmp("spi-max-khz", option_name)) {
+        _spi_max_khz = std::stoul(optarg, nullptr, 0);
+      } else if (!strcmp("no-spi-tune", option_name)) {
+        _spi_tune = false;
+      } else if (!strcmp("no-sector-jobs", option_name)) {
+        _sector_jobs = false;
+      } else if (!strcmp("no-events", option_name)) {
+        _completion_events = false;
+      } else if (!strcmp("manifest", option_name)) {
+        _manifest_path = optarg;
+      } else if (!strcmp("trace", option_name)) {
+        _trace_path = optarg;
+      } else if (!strcmp("characterize", option_name)) {
+        _characterize = true;
+      } else if (!strcmp("scratch", option_name)) {
+        _scratch_specified = true;
+        _scratch_addr = std::stoul(optarg, nullptr, 0);
+      } else if (!strcmp("no-profile", option_name)) {
+        _tuning_profile = false;
+      } else if (!strcmp("patch", option_name)) {
+        try {
+          _patches.push_back(Faff::parse_patch(optarg));
+        } catch (const Faff::Error &e) {
+          fprintf(stderr, "%s\n", e.what());
+          _arguments_invalid = true;
+        }
+      } else if (!strcmp("patches", option_name)) {
+        _patches_path = optarg;
+      } else if (!strcmp("skip-unchanged", option_name)) {
+        _skip_unchanged = true;
+      } else if (!strcmp("live", option_name)) {
+        _live = true;
+      } else if (!strcmp("reboot", option_name)) {
+        _live_reboot = true;
       }
     }
   }
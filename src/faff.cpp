@@ -0,0 +1,1360 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include <checksum.hpp>
+#include <faff.hpp>
+#include <multiboot.hpp>
+
+namespace Faff {
+
+std::string get_serial_for_device(libusb_device_handle *handle) {
+  struct libusb_device_descriptor desc;
+  int ret = libusb_get_device_descriptor(libusb_get_device(handle), &desc);
+  if (ret < 0 || !desc.iSerialNumber)
+    return "";
+
+  char buf[256];
+  ret = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
+                                           reinterpret_cast<uint8_t *>(buf),
+                                           sizeof(buf));
+  if (ret < 0)
+    return "";
+  return std::string(buf);
+}
+
+std::string get_serial_for_device(libusb_device *dev) {
+  libusb_device_handle *handle;
+  int ret = libusb_open(dev, &handle);
+  if (ret < 0)
+    return "";
+  std::string serial = get_serial_for_device(handle);
+  libusb_close(handle);
+  return serial;
+}
+
+std::unique_ptr<BitstreamFile> open_bitstream(const char *file_path) {
+  // Open the file
+  int file_fd = open(file_path, O_RDONLY);
+
+  // If we failed to open, return nullptr
+  if (file_fd < 0) {
+    return nullptr;
+  }
+
+  // Defer closing the file again
+  std::shared_ptr<void> _defer_close_fd(nullptr, [=](...) { close(file_fd); });
+
+  // Get the file size
+  const off_t file_size = lseek(file_fd, 0, SEEK_END);
+  if (file_size < 0) {
+    return nullptr;
+  }
+
+  // Move back to the start of the file
+  if (lseek(file_fd, 0, SEEK_SET) < 0) {
+    return nullptr;
+  }
+
+  // MMap up the data
+  void *mmapped_data = mmap(nullptr, // No addressing requirements
+                            file_size,
+                            PROT_READ,   // Read-only
+                            MAP_PRIVATE, // Do not share, do not change the file
+                            file_fd,     // File to map from
+                            0            // Offset 0
+  );
+
+  // If mmap failed, return nullptr
+  if (mmapped_data == MAP_FAILED) {
+    return nullptr;
+  }
+
+  // Wrap up and return
+  return std::make_unique<BitstreamFile>(
+      reinterpret_cast<uint8_t *>(mmapped_data), file_size);
+}
+
+static char nibble_to_hex(uint8_t nibble) {
+  if (nibble < 10) {
+    return '0' + nibble;
+  }
+  return 'A' + (nibble - 10);
+}
+
+static void byte_to_hex(uint8_t val, char *out_buf) {
+  out_buf[0] = nibble_to_hex((val >> 4) & 0xF);
+  out_buf[1] = nibble_to_hex((val >> 0) & 0xF);
+}
+
+static std::string format_binary_diff(const uint8_t *expected,
+                                      const uint8_t *read, unsigned byte_count,
+                                      uint32_t offset) {
+  // Two hex chars + space per byte
+  std::string expected_str(byte_count * 3, ' ');
+  std::string read_str(byte_count * 3, ' ');
+
+  // Convert hex bytes
+  for (unsigned i = 0; i < byte_count; i++) {
+    byte_to_hex(expected[i], &expected_str[i * 3]);
+    byte_to_hex(read[i], &read_str[i * 3]);
+  }
+
+  char header[64];
+  snprintf(header, sizeof(header),
+           "Verify error for block of size %u at 0x%08x:\n", byte_count,
+           offset);
+  return std::string(header) + "    Expected: " + expected_str + "\n" +
+         "    Read:     " + read_str;
+}
+
+// Report progress through one span as progress through all of them
+static ProgressCallback span_progress(const ProgressCallback &progress,
+                                      uint64_t done_before, uint64_t total) {
+  if (!progress)
+    return nullptr;
+  return [=](const Progress &span) {
+    progress(Progress{span._stage, done_before + span._done, total});
+  };
+}
+
+std::unique_ptr<BitstreamFile>
+apply_patches(const BitstreamFile &base, const std::vector<Patch> &patches,
+              const PatchVariables &variables, uint64_t max_size) {
+  // Resolve them all first, to find out how big the result is
+  std::vector<std::pair<uint32_t, std::vector<uint8_t>>> resolved;
+  uint64_t size = base._size;
+  for (const Patch &patch : patches) {
+    resolved.emplace_back(patch.offset, patch_bytes(patch, variables));
+    const uint64_t patch_end =
+        (uint64_t)patch.offset + resolved.back().second.size();
+    if (patch_end > max_size) {
+      char message[128];
+      snprintf(message, sizeof(message),
+               "Patch at 0x%08" PRIx32 " runs past the 0x%08" PRIx64
+               " bytes available for the image",
+               patch.offset, max_size);
+      throw Error(message);
+    }
+    size = std::max(size, patch_end);
+  }
+
+  // Overlapping patches are almost certainly a mistake in the offsets
+  std::sort(resolved.begin(), resolved.end());
+  for (size_t i = 1; i < resolved.size(); i++) {
+    if (resolved[i - 1].first + resolved[i - 1].second.size() >
+        resolved[i].first) {
+      char message[128];
+      snprintf(message, sizeof(message),
+               "Patches at 0x%08" PRIx32 " and 0x%08" PRIx32 " overlap",
+               resolved[i - 1].first, resolved[i].first);
+      throw Error(message);
+    }
+  }
+
+  std::vector<uint8_t> buffer(size, 0xFF);
+  memcpy(buffer.data(), base._data, base._size);
+  for (const auto &patch : resolved) {
+    std::copy(patch.second.begin(), patch.second.end(),
+              buffer.begin() + patch.first);
+  }
+  return std::make_unique<BitstreamFile>(std::move(buffer));
+}
+
+Context::Context() {
+  if (libusb_init(&_usb_context) < 0) {
+    throw Error("Failed to initialize libusb");
+  }
+}
+
+Context::~Context() { libusb_exit(_usb_context); }
+
+std::vector<std::string> Context::enumerate(const Options &options) {
+  // Get a list of all the USB devices in the system
+  libusb_device **devices;
+  ssize_t device_count = libusb_get_device_list(_usb_context, &devices);
+
+  // Create a scoped pointer to free the list again
+  std::shared_ptr<void> _defer_free_device_list(
+      nullptr,
+      [=](...) { // Decref and free device list
+        libusb_free_device_list(devices, 1);
+      });
+
+  // Iterate the devices, and if they match VID:PID collect their serial
+  std::vector<std::string> serials;
+  for (ssize_t i = 0; i < device_count; i++) {
+    // Read the descriptor for this device
+    libusb_device_descriptor desc{};
+    int ret = libusb_get_device_descriptor(devices[i], &desc);
+    if (ret < 0) {
+      char message[128];
+      snprintf(message, sizeof(message),
+               "Failed to get device descriptor: %s (%d)",
+               libusb_error_name(ret), ret);
+      throw Error(message);
+    }
+
+    // Is the VID:PID correct?
+    if (desc.idVendor != options._usb_vid || desc.idProduct != options._usb_pid)
+      continue;
+
+    // Open that device up
+    libusb_device_handle *handle;
+    ret = libusb_open(devices[i], &handle);
+    if (ret < 0) {
+      log("Failed to open device on bus %u address %u: %s (%d)",
+          libusb_get_bus_number(devices[i]),
+          libusb_get_device_address(devices[i]), libusb_error_name(ret), ret);
+      continue;
+    }
+
+    // Get the serial
+    serials.push_back(get_serial_for_device(handle));
+    libusb_close(handle);
+  }
+
+  return serials;
+}
+
+void Context::log(const char *format, ...) {
+  char message[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+
+  if (_log) {
+    _log(message);
+  } else {
+    fprintf(stderr, "%s\n", message);
+  }
+}
+
+std::unique_ptr<Programmer> Context::open(const Options &options) {
+  // Get a list of all the USB devices in the system
+  libusb_device **devices;
+  ssize_t device_count = libusb_get_device_list(_usb_context, &devices);
+
+  // Create a scoped pointer to free the list again
+  std::shared_ptr<void> _defer_free_device_list(
+      nullptr,
+      [=](...) { // Decref and free device list
+        libusb_free_device_list(devices, 1);
+      });
+
+  // Iterate the devices, and check if any of them have both the right VID:PID
+  // _and_ the right serial
+  libusb_device_handle *usb_handle = nullptr;
+  for (ssize_t i = 0; i < device_count && usb_handle == nullptr; i++) {
+    // Read the descriptor for this device
+    libusb_device_descriptor desc{};
+    int ret = libusb_get_device_descriptor(devices[i], &desc);
+    if (ret < 0) {
+      throw Error("Failed to get device descriptor");
+    }
+
+    // Is the VID:PID correct?
+    if (desc.idVendor != options._usb_vid || desc.idProduct != options._usb_pid)
+      continue;
+
+    // Open that device up
+    libusb_device_handle *handle;
+    ret = libusb_open(devices[i], &handle);
+    if (ret < 0) {
+      throw Error("Failed to open device");
+    }
+
+    // Do the options specify a device serial to use?
+    if (!options._usb_serial_specified) {
+      // Done, use this handle
+      usb_handle = handle;
+    } else {
+      // Is the serial a match?
+      std::string device_serial = get_serial_for_device(handle);
+      if (!options._usb_serial.compare(device_serial)) {
+        usb_handle = handle;
+      } else {
+        // Close it again, not a serial match
+        libusb_close(handle);
+      }
+    }
+  }
+
+  // Matching device not found
+  if (usb_handle == nullptr) {
+    char message[128];
+    snprintf(message, sizeof(message),
+             "Failed to find device with VID:PID %04x:%04x", options._usb_vid,
+             options._usb_pid);
+    throw Error(message);
+  }
+
+  // Claim programming interface
+  if (libusb_claim_interface(usb_handle, options._usb_interface) < 0) {
+    libusb_close(usb_handle);
+    char message[128];
+    snprintf(message, sizeof(message),
+             "Failed to claim usb interface 0x%02x", options._usb_interface);
+    throw Error(message);
+  }
+
+  return std::make_unique<Programmer>(_usb_context, usb_handle, options);
+}
+
+Programmer::Programmer(libusb_context *usb_context,
+                       libusb_device_handle *usb_handle,
+                       const Options &options)
+    : _usb_context(usb_context), _usb_handle(usb_handle),
+      _usb_interface(options._usb_interface),
+      _serial(get_serial_for_device(usb_handle)), _session(usb_handle, options),
+      _part() {}
+
+Programmer::~Programmer() {
+  // The session's event transfer has to go before the handle does
+  _session.close();
+  libusb_release_interface(_usb_handle, _usb_interface);
+  libusb_close(_usb_handle);
+}
+
+void Programmer::log(const char *format, ...) {
+  char message[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+
+  if (_log) {
+    _log(message);
+  } else {
+    fprintf(stderr, "%s\n", message);
+  }
+}
+
+void Programmer::report(const ProgressCallback &progress,
+                        Progress::Stage stage, uint64_t done, uint64_t total) {
+  if (progress) {
+    progress(Progress{stage, done, total});
+  }
+}
+
+void Programmer::hold_fpga() {
+  // Disable the target FPGA so that we can control the SPI flash
+  _session.cmd_fpga_reset_assert();
+  _fpga_held = true;
+  _session.cmd_set_rgb_led(0, 128, 0);
+
+  // Verify we are now in programming mode
+  if (!_session.fpga_is_under_reset()) {
+    throw Error("Failed to assert FPGA reset");
+  }
+}
+
+void Programmer::release_fpga() {
+  // Release the FPGA
+  _session.cmd_fpga_reset_deassert();
+  _fpga_held = false;
+
+  // Verify we have properly released
+  if (_session.fpga_is_under_reset()) {
+    throw Error("Failed to release FPGA reset");
+  }
+
+  // Idle led to low green
+  _session.cmd_set_rgb_led(0, 16, 0);
+}
+
+void Programmer::acquire_bus() {
+  if (!(_features & static_cast<uint32_t>(
+                        UsbProto::FeatureFlags::FEATURE_LIVE_PROGRAMMING))) {
+    throw Error("Programmer firmware can't share the SPI bus with a running "
+                "FPGA");
+  }
+
+  // Take the flash from under the running FPGA
+  if (!_session.cmd_spi_bus_acquire()) {
+    throw Error("Failed to take the SPI bus from the FPGA");
+  }
+  _bus_held = true;
+  _session.cmd_set_rgb_led(0, 64, 64);
+}
+
+void Programmer::release_bus() {
+  _session.cmd_spi_bus_release();
+  _bus_held = false;
+
+  // Idle led to low green
+  _session.cmd_set_rgb_led(0, 16, 0);
+}
+
+// Restart the FPGA, so that it configures itself from whatever the boot
+// header points at. The bus must have been released first.
+void Programmer::reboot_fpga() {
+  _session.cmd_fpga_reset_assert();
+  _fpga_held = true;
+  if (!_session.fpga_is_under_reset()) {
+    throw Error("Failed to assert FPGA reset");
+  }
+  release_fpga();
+}
+
+// Work out what flash part we are talking to. Starts from the built in part
+// table, and optionally refines that with the chip's own SFDP tables.
+void Programmer::identify_flash(const Options &options) {
+  // Get the flash chip ID
+  uint8_t flash_mfgr, flash_device;
+  uint64_t flash_unique_id;
+  _session.cmd_flash_identify(&flash_mfgr, &flash_device, &flash_unique_id);
+  log("Flash chip mfgr: 0x%02" PRIx8 ", Device ID: 0x%02" PRIx8
+      " Unique ID: 0x%016" PRIx64,
+      flash_mfgr, flash_device, flash_unique_id);
+
+  if (!FlashParts::lookup(flash_mfgr, flash_device, &_part)) {
+    _part = FlashParts::generic(flash_mfgr, flash_device);
+  }
+
+  if (options._query_sfdp) {
+    // The parameter headers and basic flash parameter table all live in the
+    // first 256 bytes on every part we've seen.
+    std::vector<uint8_t> sfdp(256);
+    const uint8_t sfdp_chunk = 64;
+    for (uint32_t offset = 0; offset < sfdp.size(); offset += sfdp_chunk) {
+      _session.cmd_flash_read_sfdp(offset, &sfdp[offset], sfdp_chunk);
+    }
+    if (FlashParts::apply_sfdp(sfdp, &_part)) {
+      log("Loaded flash parameters from SFDP");
+    } else {
+      log("No usable SFDP data, using built in parameters");
+    }
+  }
+
+  // Typical timings measured on this very chip beat the datasheet's. The
+  // worst case limits stay as they are.
+  if (_tuning.flash_mfgr == flash_mfgr &&
+      _tuning.flash_device == flash_device) {
+    const struct {
+      FlashParts::EraseSize size;
+      unsigned ms;
+    } measured_erases[] = {
+        {FlashParts::ERASE_4K, _tuning.erase_4k_ms},
+        {FlashParts::ERASE_32K, _tuning.erase_32k_ms},
+        {FlashParts::ERASE_64K, _tuning.erase_64k_ms},
+    };
+    for (const auto &measured : measured_erases) {
+      FlashParts::EraseType *type = nullptr;
+      for (FlashParts::EraseType &candidate : _part.erase_types) {
+        if (candidate.size == measured.size)
+          type = &candidate;
+      }
+      if (type != nullptr && measured.ms != 0 && measured.ms < type->max_ms) {
+        type->typ_ms = measured.ms;
+      }
+    }
+    if (_tuning.page_program_us != 0 &&
+        _tuning.page_program_us < _part.page_program_max_us) {
+      _part.page_program_typ_us = _tuning.page_program_us;
+    }
+  }
+
+  log("%s", _part.description().c_str());
+}
+
+// True if each bit position holds both a 0 and a 1 somewhere in `data`, so
+// that every SPI data line is seen at both levels whatever the bus width
+static bool exercises_every_line(const uint8_t *data, size_t size) {
+  uint8_t ones = 0x00;
+  uint8_t zeros = 0x00;
+  for (size_t i = 0; i < size; i++) {
+    ones |= data[i];
+    zeros |= ~data[i];
+  }
+  return ones == 0xFF && zeros == 0xFF;
+}
+
+// Pick the fastest SPI clock and read mode that both the programmer and the
+// flash support. Each candidate is checked by re-reading a block that was
+// first read at the slowest, single bit setting, and we step down to the next
+// candidate if it doesn't match.
+void Programmer::tune_spi_link(const Options &options, bool programming) {
+  UsbProto::SpiConfig config;
+  if (!_session.cmd_spi_query_config(&config) ||
+      config.frequencies_khz.empty()) {
+    log("Programmer does not support SPI configuration, using firmware "
+        "defaults");
+    return;
+  }
+
+  uint32_t max_khz = _part.max_read_khz;
+  if (options._spi_max_khz != 0 && options._spi_max_khz < max_khz) {
+    max_khz = options._spi_max_khz;
+  }
+  const uint8_t io_modes = config.io_modes & _part.io_modes;
+
+  // Build up the candidate settings, fastest first
+  struct Candidate {
+    uint8_t frequency_index;
+    UsbProto::SpiIoMode mode;
+    uint32_t throughput;
+  };
+  std::vector<Candidate> candidates;
+  uint8_t slowest_index = 0;
+  for (size_t i = 0; i < config.frequencies_khz.size(); i++) {
+    const uint32_t khz = config.frequencies_khz[i];
+    if (khz < config.frequencies_khz[slowest_index]) {
+      slowest_index = i;
+    }
+    if (khz > max_khz)
+      continue;
+    for (uint8_t mode = 0; mode <= 2; mode++) {
+      if (!(io_modes & (1 << mode)))
+        continue;
+      candidates.push_back(Candidate{(uint8_t)i,
+                                     static_cast<UsbProto::SpiIoMode>(mode),
+                                     khz * (1u << mode)});
+    }
+  }
+  std::sort(candidates.begin(), candidates.end(),
+            [](const Candidate &a, const Candidate &b) {
+              return a.throughput > b.throughput;
+            });
+
+  // Reference read at the most conservative setting. It's only worth
+  // anything if every data line carries both a 0 and a 1 somewhere in it, or
+  // a line stuck high or low (e.g. IO2/IO3 floating when quad mode isn't
+  // enabled on the flash) would read back as a match. Blank flash doesn't,
+  // so try the image's sector first and then the start of the flash.
+  const uint32_t validate_size = 4096;
+  const uint32_t validate_addrs[] = {options._file_lma & ~0xFFFu, 0};
+  std::vector<uint8_t> reference(validate_size);
+  std::vector<uint8_t> readback(validate_size);
+  if (!_session.cmd_spi_set_config(slowest_index,
+                                   UsbProto::SpiIoMode::SINGLE)) {
+    log("Failed to select safe SPI configuration");
+    return;
+  }
+  bool have_reference = false;
+  uint32_t validate_addr = 0;
+  for (uint32_t addr : validate_addrs) {
+    _session.cmd_flash_read_bulk(addr, reference.data(), validate_size);
+    if (exercises_every_line(reference.data(), validate_size)) {
+      have_reference = true;
+      validate_addr = addr;
+      break;
+    }
+  }
+  // On a blank board, put something there to validate against. The image's
+  // first sector is about to be erased and programmed anyway, and is only
+  // used while it's still blank, so this never needs an erase.
+  const uint32_t image_sector = options._file_lma;
+  if (!have_reference && programming && image_sector % validate_size == 0 &&
+      (_part.capacity == 0 || image_sector < _part.capacity)) {
+    _session.cmd_flash_read_bulk(image_sector, reference.data(),
+                                 validate_size);
+    if (std::all_of(reference.begin(), reference.end(),
+                    [](uint8_t byte) { return byte == 0xFF; })) {
+      log("SPI link: flash is blank, validating against a test pattern at "
+          "0x%08" PRIx32,
+          image_sector);
+      for (uint32_t i = 0; i < validate_size; i++) {
+        reference[i] = i ^ (i >> 8);
+      }
+      program_range(image_sector, reference.data(), validate_size,
+                    _tuning.write_chunk, nullptr);
+      _session.cmd_flash_read_bulk(image_sector, reference.data(),
+                                   validate_size);
+      if (exercises_every_line(reference.data(), validate_size)) {
+        have_reference = true;
+        validate_addr = image_sector;
+      }
+    }
+  }
+  if (!have_reference) {
+    _session.cmd_spi_set_config(config.frequency_index, config.io_mode);
+    log("SPI link: no flash contents to validate faster settings against, "
+        "staying at programmer defaults");
+    return;
+  }
+
+  const char *mode_names[] = {"single", "dual", "quad"};
+  for (const Candidate &candidate : candidates) {
+    const uint32_t khz = config.frequencies_khz[candidate.frequency_index];
+    const char *mode_name = mode_names[static_cast<uint8_t>(candidate.mode)];
+    if (!_session.cmd_spi_set_config(candidate.frequency_index,
+                                     candidate.mode))
+      continue;
+    _session.cmd_flash_read_bulk(validate_addr, readback.data(),
+                                 validate_size);
+    if (readback == reference) {
+      log("SPI link: %ukHz, %s I/O", khz, mode_name);
+      return;
+    }
+    log("SPI link failed validation at %ukHz %s I/O", khz, mode_name);
+  }
+
+  // Nothing else worked, stay on the setting the reference was read at
+  _session.cmd_spi_set_config(slowest_index, UsbProto::SpiIoMode::SINGLE);
+  log("SPI link: %ukHz, single I/O", config.frequencies_khz[slowest_index]);
+}
+
+// Wait for the flash to finish the operation issued at `addr`. If the
+// programmer sends completion events we just wait for that. Otherwise give the
+// flash the typical time for the operation, then poll the busy flag. Either
+// way, fail if the flash is still busy well after the worst case time.
+// Returns how long the wait took, in microseconds.
+uint32_t Programmer::wait_flash_idle(uint32_t typ_us, uint32_t max_us,
+                                     const char *action, uint32_t addr) {
+  const auto start = std::chrono::steady_clock::now();
+  // Allow for USB latency on top of the datasheet worst case
+  const auto deadline = start + std::chrono::microseconds(max_us) +
+                        std::chrono::milliseconds(100);
+
+  bool idle = false;
+  if (_session.completion_events_enabled()) {
+    UsbProto::Event event;
+    idle = _session.wait_event(UsbProto::EventType::FLASH_IDLE, addr, deadline,
+                               &event);
+  } else {
+    const uint32_t poll_us = (typ_us / 8) > _tuning.poll_interval_us
+                                 ? (typ_us / 8)
+                                 : _tuning.poll_interval_us;
+    usleep(typ_us);
+    while (!(idle = !_session.flash_busy())) {
+      if (std::chrono::steady_clock::now() > deadline)
+        break;
+      usleep(poll_us);
+    }
+  }
+
+  if (!idle) {
+    char message[128];
+    snprintf(message, sizeof(message),
+             "Timed out waiting for %s at 0x%08" PRIx32, action, addr);
+    throw Error(message);
+  }
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+void Programmer::erase(const FlashParts::EraseOp &op) {
+  switch (op.type->size) {
+  case FlashParts::ERASE_4K:
+    _session.cmd_flash_erase_4k(op.addr);
+    break;
+  case FlashParts::ERASE_32K:
+    _session.cmd_flash_erase_32k(op.addr);
+    break;
+  case FlashParts::ERASE_64K:
+    _session.cmd_flash_erase_64k(op.addr);
+    break;
+  }
+}
+
+// Pick up the profile saved by --characterize for this programmer, if any.
+// Without one, the defaults in Tuning apply.
+void Programmer::load_tuning_profile(const Options &options) {
+  _tuning = Tuning();
+  const std::string path = tuning_profile_path(_serial);
+  std::vector<std::string> unknown_keys;
+  if (options._tuning_profile && !path.empty() &&
+      load_tuning(path, &_tuning, &unknown_keys)) {
+    log("Using tuning profile %s", path.c_str());
+    for (const std::string &key : unknown_keys) {
+      log("Ignoring unknown key '%s' in %s", key.c_str(), path.c_str());
+    }
+  }
+  apply_tuning();
+}
+
+void Programmer::apply_tuning() {
+  _session.set_timeouts(_tuning.command_timeout_ms,
+                        _tuning.bulk_timeout_us_per_kib);
+}
+
+// Common setup for every operation: take control of the flash, find out what
+// we're talking to, and get the link up to speed.
+void Programmer::begin_operation(const Options &options, bool programming) {
+  load_tuning_profile(options);
+  // Whether the FPGA can keep running depends on what the firmware supports
+  _features = _session.cmd_query_features();
+  if (options._live) {
+    acquire_bus();
+  } else {
+    hold_fpga();
+  }
+  if (options._completion_events &&
+      (_features & static_cast<uint32_t>(
+                       UsbProto::FeatureFlags::FEATURE_COMPLETION_EVENTS))) {
+    _session.enable_completion_events(_usb_context);
+  }
+  identify_flash(options);
+  if (options._spi_tune) {
+    tune_spi_link(options, programming);
+  }
+  // Indicator LED to yellow for act
+  _session.cmd_set_rgb_led(64, 32, 0);
+}
+
+void Programmer::end_operation() {
+  _session.disable_completion_events();
+  if (_bus_held) {
+    release_bus();
+  }
+  if (_fpga_held) {
+    release_fpga();
+  }
+}
+
+// Best effort version of end_operation, for when an operation has failed.
+// Each step is tried regardless of the others, since the device may well be
+// the reason we're here.
+void Programmer::abandon_operation() {
+  try {
+    _session.disable_completion_events();
+  } catch (const Error &) {
+  }
+  if (_bus_held) {
+    try {
+      release_bus();
+    } catch (const Error &) {
+    }
+  }
+  if (_fpga_held) {
+    try {
+      release_fpga();
+    } catch (const Error &) {
+    }
+  }
+}
+
+std::future<void>
+Programmer::program(std::shared_ptr<const BitstreamFile> image,
+                    const Options &options, ProgressCallback progress) {
+  return std::async(std::launch::async, [this, image, options, progress]() {
+    std::lock_guard<std::mutex> lock(_operation_mutex);
+    OperationGuard guard(this);
+    // A live update's slot is only checked later, so leave it alone until then
+    begin_operation(options, !options._live);
+    if (options._live) {
+      run_program_live(*image, options, progress);
+    } else {
+      run_program(*image, options, progress);
+    }
+    end_operation();
+    if (options._live && options._live_reboot) {
+      reboot_fpga();
+    }
+  });
+}
+
+std::future<void> Programmer::read(uint32_t addr, uint32_t length,
+                                   const Options &options, ReadCallback sink,
+                                   ProgressCallback progress) {
+  return std::async(std::launch::async,
+                    [this, addr, length, options, sink, progress]() {
+                      std::lock_guard<std::mutex> lock(_operation_mutex);
+                      OperationGuard guard(this);
+                      begin_operation(options);
+                      run_read(addr, length, options, sink, progress);
+                      end_operation();
+                    });
+}
+
+std::future<Tuning> Programmer::characterize(const Options &options,
+                                             uint32_t scratch_addr) {
+  return std::async(std::launch::async, [this, options, scratch_addr]() {
+    std::lock_guard<std::mutex> lock(_operation_mutex);
+    // Measure from the defaults, not from whatever we measured last time
+    Options untuned = options;
+    untuned._tuning_profile = false;
+    OperationGuard guard(this);
+    begin_operation(untuned);
+    Tuning tuning = run_characterize(scratch_addr);
+    end_operation();
+    return tuning;
+  });
+}
+
+// Stamp this board's data over the shared image. Returns nullptr if there are
+// no patches, in which case `base` should be used as it is.
+std::unique_ptr<BitstreamFile>
+Programmer::patch_image(const BitstreamFile &base, const Options &options) {
+  if (options._patches.empty())
+    return nullptr;
+  // Check patches against the flash before building the image, so that a
+  // mistyped offset doesn't turn into gigabytes of padding
+  uint64_t max_size = UINT64_MAX;
+  if (_part.capacity != 0) {
+    max_size = options._file_lma < _part.capacity
+                   ? _part.capacity - options._file_lma
+                   : 0;
+  }
+  std::unique_ptr<BitstreamFile> patched = apply_patches(
+      base, options._patches, {{"serial", _serial}}, max_size);
+  log("Applied %zu patches for serial %s", options._patches.size(),
+      _serial.c_str());
+  return patched;
+}
+
+void Programmer::run_program(const BitstreamFile &base, const Options &options,
+                             const ProgressCallback &progress) {
+  std::unique_ptr<BitstreamFile> patched = patch_image(base, options);
+  const BitstreamFile &image = patched != nullptr ? *patched : base;
+
+  const uint32_t start = options._file_lma;
+  const uint64_t end = (uint64_t)start + image._size;
+
+  // Make sure the image actually fits before we erase anything
+  if (_part.capacity == 0) {
+    log("Warning: flash size unknown, unable to check that the image fits");
+  } else if (end > _part.capacity) {
+    char message[128];
+    snprintf(message, sizeof(message),
+             "Image of 0x%08lx bytes at 0x%08x runs past the end of the "
+             "0x%08x byte flash",
+             image._size, start, _part.capacity);
+    throw Error(message);
+  }
+
+  // Normally the whole image gets written, but sectors that already hold the
+  // right data can be left alone if asked
+  std::vector<Span> spans;
+  if (options._skip_unchanged) {
+    spans = find_changed_spans(image, start, progress);
+    uint64_t changed = 0;
+    for (const Span &span : spans) {
+      changed += span.end - span.start;
+    }
+    log("0x%08" PRIx64 " of 0x%08lx bytes differ from the flash", changed,
+        image._size);
+    if (spans.empty())
+      return;
+  } else {
+    spans.push_back(Span{start, end});
+  }
+
+  // Prefer to let the programmer do the work, if it can
+  const bool sector_jobs_supported =
+      (_features & static_cast<uint32_t>(
+                       UsbProto::FeatureFlags::FEATURE_SECTOR_JOBS)) &&
+      _part.erase_type(FlashParts::ERASE_4K) != nullptr;
+  if (options._sector_jobs && sector_jobs_supported) {
+    run_program_sector_jobs(image, spans, options, progress);
+    return;
+  }
+
+  // Erase every sector the spans touch, using the largest erase blocks that
+  // fit
+  std::vector<FlashParts::EraseOp> erase_plan;
+  for (const Span &span : spans) {
+    std::vector<FlashParts::EraseOp> span_plan =
+        FlashParts::plan_erase(_part, span.start, span.end);
+    erase_plan.insert(erase_plan.end(), span_plan.begin(), span_plan.end());
+  }
+  uint64_t erase_total = 0;
+  for (const FlashParts::EraseOp &op : erase_plan) {
+    erase_total += op.type->size;
+  }
+  uint64_t erase_done = 0;
+  for (const FlashParts::EraseOp &op : erase_plan) {
+    report(progress, Progress::Stage::ERASE, erase_done, erase_total);
+    erase(op);
+    wait_flash_idle(op.type->typ_ms * 1000, op.type->max_ms * 1000, "erase",
+                    op.addr);
+    erase_done += op.type->size;
+  }
+  report(progress, Progress::Stage::ERASE, erase_done, erase_total);
+
+  uint64_t total = 0;
+  for (const Span &span : spans) {
+    total += span.end - span.start;
+  }
+  uint64_t done = 0;
+  for (const Span &span : spans) {
+    program_range(span.start, &image._data[span.start - start],
+                  span.end - span.start, _tuning.write_chunk,
+                  span_progress(progress, done, total));
+    done += span.end - span.start;
+  }
+  report(progress, Progress::Stage::PROGRAM, total, total);
+
+  // If it wasn't disabled, perform a re-read of the flash to verify
+  if (options._verify_programmed) {
+    done = 0;
+    for (const Span &span : spans) {
+      verify_range(span.start, &image._data[span.start - start],
+                   span.end - span.start, span_progress(progress, done, total));
+      done += span.end - span.start;
+    }
+    report(progress, Progress::Stage::VERIFY, total, total);
+  }
+}
+
+// Program an inactive slot of a multiboot flash while the FPGA keeps running,
+// then switch the boot header over to it. Until the header is rewritten a
+// reset still boots the old image, so the only time the flash doesn't hold a
+// bootable configuration is the rewrite of that one sector at the very end.
+void Programmer::run_program_live(const BitstreamFile &base,
+                                  const Options &options,
+                                  const ProgressCallback &progress) {
+  const uint32_t sector_size = _part.min_erase_size();
+  if (sector_size == 0) {
+    throw Error("Flash erase size unknown, unable to update a slot live");
+  }
+
+  // The header shares its sector with whatever else is in there, and all of
+  // it has to be put back when the header is rewritten
+  std::vector<uint8_t> header(sector_size);
+  _session.cmd_flash_read_bulk(0, header.data(), sector_size);
+  uint32_t entries[Multiboot::entry_count];
+  if (!Multiboot::parse(header.data(), header.size(), entries)) {
+    throw Error("No multiboot header at the start of the flash, so there is "
+                "no inactive slot to program");
+  }
+  const uint32_t active = entries[Multiboot::power_on_entry];
+
+  std::unique_ptr<BitstreamFile> patched = patch_image(base, options);
+  const BitstreamFile &image = patched != nullptr ? *patched : base;
+
+  const uint32_t slot = options._file_lma;
+  const uint64_t slot_end = (uint64_t)slot + image._size;
+  const uint64_t slot_erase_end =
+      (slot_end + sector_size - 1) & ~(uint64_t)(sector_size - 1);
+  if (slot < sector_size || slot % sector_size != 0) {
+    char message[128];
+    snprintf(message, sizeof(message),
+             "Slot address 0x%08" PRIx32 " must be sector aligned, and "
+             "clear of the header in the first 0x%" PRIx32 " bytes",
+             slot, sector_size);
+    throw Error(message);
+  }
+  // We can't tell where the running image ends, but iCE40 bitstreams for
+  // one device are all the same size, so it can't be longer than this one
+  if (slot < (uint64_t)active + image._size && active < slot_erase_end) {
+    char message[128];
+    snprintf(message, sizeof(message),
+             "Slot at 0x%08" PRIx32 " overlaps the image at 0x%08" PRIx32
+             " that the FPGA boots from",
+             slot, active);
+    throw Error(message);
+  }
+  for (unsigned i = 0; i < Multiboot::entry_count; i++) {
+    if (i != Multiboot::power_on_entry && entries[i] == slot) {
+      log("Warning: a warmboot to image %u before the update finishes "
+          "will load a partial image",
+          i - 1);
+    }
+  }
+
+  // Switching to an image that hasn't been read back would defeat the point
+  Options slot_options = options;
+  slot_options._patches.clear();
+  slot_options._verify_programmed = true;
+  log("Programming slot at 0x%08" PRIx32 ", FPGA running from 0x%08" PRIx32,
+      slot, active);
+  run_program(image, slot_options, progress);
+
+  // Everything that booted the old image boots the new one from now on
+  const std::vector<uint8_t> old_header = header;
+  for (unsigned i = 0; i < Multiboot::entry_count; i++) {
+    if (entries[i] == active) {
+      Multiboot::set_entry(header.data(), i, slot);
+    }
+  }
+
+  // Sector 0 may be left erased or half written if the rewrite fails, and
+  // then the board won't boot at all. Try again, and failing that, put the
+  // old header back.
+  const auto start = std::chrono::steady_clock::now();
+  try {
+    write_boot_sector(header, slot_options);
+  } catch (const std::exception &first) {
+    log("Boot header rewrite failed: %s. Retrying", first.what());
+    try {
+      write_boot_sector(header, slot_options);
+    } catch (const std::exception &retry) {
+      log("Boot header retry failed: %s. Restoring the old header",
+          retry.what());
+      try {
+        write_boot_sector(old_header, slot_options);
+      } catch (const std::exception &restore) {
+        log("ERROR: FAILED TO RESTORE THE BOOT HEADER: %s. The board will not "
+            "boot until a valid multiboot header is written to the start of "
+            "the flash",
+            restore.what());
+        throw;
+      }
+      char message[256];
+      snprintf(message, sizeof(message),
+               "Failed to switch the boot header (%s), it still boots the "
+               "image at 0x%08" PRIx32,
+               first.what(), active);
+      throw Error(message);
+    }
+  }
+  log("Boot header switched from 0x%08" PRIx32 " to 0x%08" PRIx32
+      " in %lldms",
+      active, slot,
+      (long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - start)
+          .count());
+}
+
+// Rewrite the sector holding the multiboot header, and read it back
+void Programmer::write_boot_sector(std::vector<uint8_t> sector,
+                                   const Options &options) {
+  // Erased bytes at the end of the sector come back erased anyway, so leave
+  // them out to keep the rewrite short
+  size_t used = sector.size();
+  while (used > Multiboot::header_size && sector[used - 1] == 0xFF) {
+    used--;
+  }
+  sector.resize(used);
+
+  Options sector_options = options;
+  sector_options._file_lma = 0;
+  sector_options._patches.clear();
+  sector_options._skip_unchanged = false;
+  sector_options._verify_programmed = true;
+  run_program(BitstreamFile(std::move(sector)), sector_options, nullptr);
+}
+
+// Read back the flash under the image, and work out which of the sectors it
+// covers don't already match. Returns them as address ordered spans of
+// adjacent sectors, trimmed to the image.
+std::vector<Programmer::Span>
+Programmer::find_changed_spans(const BitstreamFile &image, uint32_t start,
+                               const ProgressCallback &progress) {
+  const uint64_t end = (uint64_t)start + image._size;
+  const uint32_t sector_size = _part.min_erase_size();
+  if (sector_size == 0) {
+    throw Error("Flash erase size unknown, unable to skip unchanged sectors");
+  }
+  const uint64_t first_sector = start & ~(uint64_t)(sector_size - 1);
+
+  // Read in whole sectors' worth, as close to the tuned block size as we can
+  const uint32_t block_size =
+      std::max(sector_size, _tuning.read_block / sector_size * sector_size);
+  std::vector<uint8_t> block(block_size);
+  std::vector<Span> spans;
+  for (uint64_t block_addr = first_sector; block_addr < end;
+       block_addr += block_size) {
+    const uint64_t read_start = std::max<uint64_t>(block_addr, start);
+    const uint64_t read_end = std::min(block_addr + block_size, end);
+    report(progress, Progress::Stage::READ, read_start - start, image._size);
+    _session.cmd_flash_read_bulk(read_start, block.data(),
+                                 read_end - read_start);
+
+    for (uint64_t sector = block_addr; sector < read_end;
+         sector += sector_size) {
+      const uint64_t piece_start = std::max(sector, read_start);
+      const uint64_t piece_end = std::min(sector + sector_size, read_end);
+      if (memcmp(&block[piece_start - read_start],
+                 &image._data[piece_start - start],
+                 piece_end - piece_start) == 0)
+        continue;
+
+      // Extend the last span if this sector follows straight on from it
+      if (!spans.empty() && spans.back().end == piece_start) {
+        spans.back().end = piece_end;
+      } else {
+        spans.push_back(Span{(uint32_t)piece_start, piece_end});
+      }
+    }
+  }
+  report(progress, Progress::Stage::READ, image._size, image._size);
+  return spans;
+}
+
+// Read back `size` bytes at `addr`, and throw with a diff of the first bad
+// line if they don't match `expected`.
+void Programmer::verify_range(uint32_t addr, const uint8_t *expected,
+                              uint32_t size, const ProgressCallback &progress) {
+  const uint32_t verify_block_size = _tuning.read_block;
+  std::vector<uint8_t> data(verify_block_size);
+  for (uint32_t byte_offset = 0; byte_offset < size;) {
+    uint32_t bytes_to_copy = verify_block_size;
+    if (bytes_to_copy > size - byte_offset) {
+      bytes_to_copy = size - byte_offset;
+    }
+    report(progress, Progress::Stage::VERIFY, byte_offset, size);
+    _session.cmd_flash_read_bulk(addr + byte_offset, data.data(),
+                                 bytes_to_copy);
+
+    // Compare the read block with the real bitstream
+    if (memcmp(data.data(), &expected[byte_offset], bytes_to_copy) != 0) {
+      // Narrow it down to the first bad 32 byte line for the diff
+      uint32_t line = 0;
+      while (data[line] == expected[byte_offset + line]) {
+        line++;
+      }
+      line &= ~31u;
+      const uint32_t line_size =
+          (bytes_to_copy - line) < 32 ? (bytes_to_copy - line) : 32;
+      throw Error(format_binary_diff(&expected[byte_offset + line],
+                                     &data[line], line_size,
+                                     addr + byte_offset + line));
+    }
+
+    // Increment byte offset
+    byte_offset += bytes_to_copy;
+  }
+}
+
+// Write `size` bytes to already erased flash at `addr`, `chunk` bytes per
+// FLASH_WRITE.
+void Programmer::program_range(uint32_t addr, const uint8_t *data,
+                               uint32_t size, uint32_t chunk,
+                               const ProgressCallback &progress) {
+  // Writes may not cross a page boundary, or they wrap around to the start
+  // of the page.
+  for (uint32_t byte_offset = 0; byte_offset < size;) {
+    const uint32_t write_addr = addr + byte_offset;
+    const uint32_t page_remaining =
+        _part.page_size - (write_addr % _part.page_size);
+    uint32_t bytes_to_copy = chunk < page_remaining ? chunk : page_remaining;
+    if (bytes_to_copy > size - byte_offset) {
+      bytes_to_copy = size - byte_offset;
+    }
+
+    report(progress, Progress::Stage::PROGRAM, byte_offset, size);
+    _session.cmd_flash_write(write_addr, &data[byte_offset], bytes_to_copy);
+
+    // Increment byte offset
+    byte_offset += bytes_to_copy;
+
+    // Wait for write in progress bit to clear again. Program time scales
+    // with the number of bytes, but the worst case doesn't.
+    const uint32_t typ_us =
+        _part.page_program_typ_us * bytes_to_copy / _part.page_size;
+    wait_flash_idle(typ_us, _part.page_program_max_us, "write", write_addr);
+  }
+}
+
+// Wait for the job in `slot` to finish, and check that it succeeded.
+void Programmer::wait_sector_job(uint8_t slot, uint32_t addr, uint32_t typ_us,
+                                 uint32_t max_us) {
+  // The job may be queued behind the one in the other slot, so allow for
+  // that one's worst case too
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::microseconds(2 * max_us) +
+                        std::chrono::milliseconds(100);
+  const uint32_t poll_us = (typ_us / 4) > _tuning.poll_interval_us
+                               ? (typ_us / 4)
+                               : _tuning.poll_interval_us;
+
+  UsbProto::SectorJobState states[UsbProto::sector_job_slots];
+  for (;;) {
+    UsbProto::SectorJobState state;
+    UsbProto::Event event;
+    if (!_session.completion_events_enabled()) {
+      _session.cmd_sector_job_status(states);
+      state = states[slot];
+    } else if (_session.wait_event(UsbProto::EventType::SECTOR_JOB_DONE, addr,
+                                   deadline, &event)) {
+      state = static_cast<UsbProto::SectorJobState>(event.status);
+    } else {
+      // Deadline passed, the timeout check below will catch it
+      state = UsbProto::SectorJobState::BUSY;
+    }
+    if (state == UsbProto::SectorJobState::DONE) {
+      return;
+    }
+
+    const char *error = nullptr;
+    switch (state) {
+    case UsbProto::SectorJobState::ERR_CRC:
+      error = "CRC mismatch on upload";
+      break;
+    case UsbProto::SectorJobState::ERR_VERIFY:
+      error = "verify failed";
+      break;
+    case UsbProto::SectorJobState::ERR_TIMEOUT:
+      error = "flash timed out";
+      break;
+    case UsbProto::SectorJobState::IDLE:
+      error = "job was lost";
+      break;
+    default:
+      break;
+    }
+    if (error == nullptr && std::chrono::steady_clock::now() > deadline) {
+      error = "timed out waiting for programmer";
+    }
+    if (error != nullptr) {
+      char message[128];
+      snprintf(message, sizeof(message),
+               "Sector job for 0x%08" PRIx32 " failed: %s", addr, error);
+      throw Error(message);
+    }
+
+    usleep(poll_us);
+  }
+}
+
+// Program the image one 4k sector at a time, uploading each sector to the
+// programmer and letting it erase, program and verify the sector from its own
+// RAM. With two job slots the next sector is uploaded while the current one is
+// being written, so USB transfer time hides behind flash busy time.
+void Programmer::run_program_sector_jobs(const BitstreamFile &image,
+                                         const std::vector<Span> &spans,
+                                         const Options &options,
+                                         const ProgressCallback &progress) {
+  const uint32_t sector_size = UsbProto::sector_job_size;
+  const uint32_t start = options._file_lma;
+  const uint64_t end = (uint64_t)start + image._size;
+
+  // Every sector the spans touch gets a job. Spans never share a sector.
+  std::vector<uint32_t> sectors;
+  for (const Span &span : spans) {
+    for (uint64_t sector = span.start & ~(sector_size - 1); sector < span.end;
+         sector += sector_size) {
+      sectors.push_back(sector);
+    }
+  }
+  std::vector<bool> job_erase(sectors.size(), true);
+
+  // A single large erase is much quicker than the equivalent 4k erases, so
+  // do those up front. Anything only covered by 4k erases is left to the job.
+  std::vector<FlashParts::EraseOp> block_erases;
+  for (const Span &span : spans) {
+    for (const FlashParts::EraseOp &op :
+         FlashParts::plan_erase(_part, span.start, span.end)) {
+      if (op.type->size != FlashParts::ERASE_4K) {
+        block_erases.push_back(op);
+      }
+    }
+  }
+  uint64_t erase_total = 0;
+  for (const FlashParts::EraseOp &op : block_erases) {
+    erase_total += op.type->size;
+  }
+  uint64_t erase_done = 0;
+  for (const FlashParts::EraseOp &op : block_erases) {
+    report(progress, Progress::Stage::ERASE, erase_done, erase_total);
+    erase(op);
+    wait_flash_idle(op.type->typ_ms * 1000, op.type->max_ms * 1000, "erase",
+                    op.addr);
+    for (uint32_t offset = 0; offset < op.type->size; offset += sector_size) {
+      auto it = std::lower_bound(sectors.begin(), sectors.end(),
+                                 op.addr + offset);
+      if (it != sectors.end() && *it == op.addr + offset) {
+        job_erase[it - sectors.begin()] = false;
+      }
+    }
+    erase_done += op.type->size;
+  }
+  if (!block_erases.empty()) {
+    report(progress, Progress::Stage::ERASE, erase_done, erase_total);
+  }
+
+  // Expected time for one job, for polling
+  const FlashParts::EraseType *erase_4k =
+      _part.erase_type(FlashParts::ERASE_4K);
+  const uint32_t pages_per_sector = sector_size / _part.page_size;
+  const uint32_t job_typ_us = erase_4k->typ_ms * 1000 +
+                              pages_per_sector * _part.page_program_typ_us;
+  const uint32_t job_max_us = erase_4k->max_ms * 1000 +
+                              pages_per_sector * _part.page_program_max_us;
+
+  uint64_t total = 0;
+  for (const Span &span : spans) {
+    total += span.end - span.start;
+  }
+  uint64_t done = 0;
+  std::vector<uint8_t> sector_data(sector_size);
+  bool slot_busy[UsbProto::sector_job_slots] = {};
+  uint32_t slot_addr[UsbProto::sector_job_slots] = {};
+  unsigned job = 0;
+  for (; job < sectors.size(); job++) {
+    const uint64_t sector = sectors[job];
+    const uint8_t slot = job % UsbProto::sector_job_slots;
+    report(progress, Progress::Stage::PROGRAM, done, total);
+
+    // Wait for the last job in this slot before reusing its buffer
+    if (slot_busy[slot]) {
+      wait_sector_job(slot, slot_addr[slot], job_typ_us, job_max_us);
+      slot_busy[slot] = false;
+    }
+
+    // Anything in the sector outside the image is left erased, just as when
+    // the host drives the writes
+    std::fill(sector_data.begin(), sector_data.end(), 0xFF);
+    const uint64_t copy_start = sector > start ? sector : start;
+    const uint64_t copy_end =
+        (sector + sector_size) < end ? (sector + sector_size) : end;
+    memcpy(&sector_data[copy_start - sector], &image._data[copy_start - start],
+           copy_end - copy_start);
+
+    uint8_t flags = 0;
+    if (job_erase[job]) {
+      flags |= static_cast<uint8_t>(UsbProto::SectorJobFlags::JOB_ERASE);
+    }
+    if (options._verify_programmed) {
+      flags |= static_cast<uint8_t>(UsbProto::SectorJobFlags::JOB_VERIFY);
+    }
+    _session.cmd_sector_job_load(slot, sector_data.data(), sector_size);
+    _session.cmd_sector_job_commit(
+        slot, sector, Checksum::crc32(sector_data.data(), sector_size), flags);
+    slot_busy[slot] = true;
+    slot_addr[slot] = sector;
+    done += copy_end - copy_start;
+  }
+
+  // Drain the remaining jobs, oldest first
+  for (unsigned i = 0; i < UsbProto::sector_job_slots; i++) {
+    const uint8_t slot = (job + i) % UsbProto::sector_job_slots;
+    if (slot_busy[slot]) {
+      wait_sector_job(slot, slot_addr[slot], job_typ_us, job_max_us);
+    }
+  }
+  report(progress, Progress::Stage::PROGRAM, total, total);
+}
+
+void Programmer::run_read(uint32_t addr, uint32_t length,
+                          const Options &options, const ReadCallback &sink,
+                          const ProgressCallback &progress) {
+  // Work out how much we need to read
+  if (length == 0) {
+    if (_part.capacity == 0) {
+      throw Error("Unable to determine flash size, please specify a length");
+    } else if (addr >= _part.capacity) {
+      char message[128];
+      snprintf(message, sizeof(message),
+               "Read address 0x%08x is beyond the end of the flash", addr);
+      throw Error(message);
+    }
+    length = _part.capacity - addr;
+  }
+  if (_part.capacity != 0 && (uint64_t)addr + length > _part.capacity) {
+    char message[128];
+    snprintf(message, sizeof(message),
+             "Read of 0x%08x bytes at 0x%08x runs past the end of the "
+             "0x%08x byte flash",
+             length, addr, _part.capacity);
+    throw Error(message);
+  }
+
+  // Read in large blocks so that we only pay the command round trip once per
+  // block
+  const uint32_t read_block_size = _tuning.read_block;
+  std::vector<uint8_t> block(read_block_size);
+  for (uint32_t offset = 0; offset < length;) {
+    const uint32_t block_size = (length - offset) < read_block_size
+                                    ? (length - offset)
+                                    : read_block_size;
+    report(progress, Progress::Stage::READ, offset, length);
+    _session.cmd_flash_read_bulk(addr + offset, block.data(), block_size);
+    sink(addr + offset, block.data(), block_size);
+    offset += block_size;
+  }
+  report(progress, Progress::Stage::READ, length, length);
+}
+
+} // namespace Faff
@@ -0,0 +1,250 @@
+#include <flash_parts.hpp>
+
+namespace FlashParts {
+
+/* clang-format off */
+// Typical / max figures are taken from the datasheets. Where a family has
+// several revisions, the slowest revision's numbers are used.
+static const FlashPart known_parts[] = {
+    // Winbond
+    {"W25Q80",   0xEF, 0x13, 1 << 20, 256, {{ERASE_4K, 45, 400}, {ERASE_32K, 120, 1600}, {ERASE_64K, 150, 2000}}, 700, 3000, 104000, IO_SINGLE | IO_DUAL | IO_QUAD},
+    {"W25Q16",   0xEF, 0x14, 2 << 20, 256, {{ERASE_4K, 45, 400}, {ERASE_32K, 120, 1600}, {ERASE_64K, 150, 2000}}, 700, 3000, 104000, IO_SINGLE | IO_DUAL | IO_QUAD},
+    {"W25Q32",   0xEF, 0x15, 4 << 20, 256, {{ERASE_4K, 45, 400}, {ERASE_32K, 120, 1600}, {ERASE_64K, 150, 2000}}, 700, 3000, 104000, IO_SINGLE | IO_DUAL | IO_QUAD},
+    {"W25Q64",   0xEF, 0x16, 8 << 20, 256, {{ERASE_4K, 45, 400}, {ERASE_32K, 120, 1600}, {ERASE_64K, 150, 2000}}, 700, 3000, 104000, IO_SINGLE | IO_DUAL | IO_QUAD},
+    {"W25Q128",  0xEF, 0x17, 16 << 20, 256, {{ERASE_4K, 45, 400}, {ERASE_32K, 120, 1600}, {ERASE_64K, 150, 2000}}, 700, 3000, 104000, IO_SINGLE | IO_DUAL | IO_QUAD},
+    // GigaDevice
+    {"GD25Q16",  0xC8, 0x14, 2 << 20, 256, {{ERASE_4K, 45, 300}, {ERASE_32K, 150, 800}, {ERASE_64K, 250, 1200}}, 600, 2400, 104000, IO_SINGLE | IO_DUAL | IO_QUAD},
+    {"GD25Q32",  0xC8, 0x15, 4 << 20, 256, {{ERASE_4K, 45, 300}, {ERASE_32K, 150, 800}, {ERASE_64K, 250, 1200}}, 600, 2400, 104000, IO_SINGLE | IO_DUAL | IO_QUAD},
+    {"GD25Q64",  0xC8, 0x16, 8 << 20, 256, {{ERASE_4K, 45, 300}, {ERASE_32K, 150, 800}, {ERASE_64K, 250, 1200}}, 600, 2400, 104000, IO_SINGLE | IO_DUAL | IO_QUAD},
+    // Macronix
+    {"MX25L16",  0xC2, 0x14, 2 << 20, 256, {{ERASE_4K, 40, 200}, {ERASE_32K, 200, 1000}, {ERASE_64K, 400, 2000}}, 600, 3000, 86000, IO_SINGLE | IO_DUAL},
+    {"MX25L32",  0xC2, 0x15, 4 << 20, 256, {{ERASE_4K, 40, 200}, {ERASE_32K, 200, 1000}, {ERASE_64K, 400, 2000}}, 600, 3000, 86000, IO_SINGLE | IO_DUAL},
+    {"MX25L64",  0xC2, 0x16, 8 << 20, 256, {{ERASE_4K, 40, 200}, {ERASE_32K, 200, 1000}, {ERASE_64K, 400, 2000}}, 600, 3000, 86000, IO_SINGLE | IO_DUAL},
+    // ISSI
+    {"IS25LP016", 0x9D, 0x14, 2 << 20, 256, {{ERASE_4K, 70, 300}, {ERASE_32K, 100, 500}, {ERASE_64K, 150, 1000}}, 200, 800, 133000, IO_SINGLE | IO_DUAL | IO_QUAD},
+    {"IS25LP032", 0x9D, 0x15, 4 << 20, 256, {{ERASE_4K, 70, 300}, {ERASE_32K, 100, 500}, {ERASE_64K, 150, 1000}}, 200, 800, 133000, IO_SINGLE | IO_DUAL | IO_QUAD},
+    {"IS25LP064", 0x9D, 0x16, 8 << 20, 256, {{ERASE_4K, 70, 300}, {ERASE_32K, 100, 500}, {ERASE_64K, 150, 1000}}, 200, 800, 133000, IO_SINGLE | IO_DUAL | IO_QUAD},
+};
+/* clang-format on */
+
+const EraseType *FlashPart::erase_type(uint32_t size) const {
+  for (unsigned i = 0; i < max_erase_types; i++) {
+    if (erase_types[i].size == size)
+      return &erase_types[i];
+  }
+  return nullptr;
+}
+
+uint32_t FlashPart::min_erase_size() const {
+  uint32_t min_size = 0;
+  for (unsigned i = 0; i < max_erase_types; i++) {
+    if (erase_types[i].size == 0)
+      continue;
+    if (min_size == 0 || erase_types[i].size < min_size)
+      min_size = erase_types[i].size;
+  }
+  return min_size;
+}
+
+std::string FlashPart::description() const {
+  std::string desc = "Flash part: " + name + ", ";
+  if (capacity) {
+    desc += std::to_string(capacity / 1024) + " KiB, ";
+  } else {
+    desc += "unknown size, ";
+  }
+  desc += std::to_string(page_size) + " byte pages, erase sizes:";
+  for (unsigned i = 0; i < max_erase_types; i++) {
+    if (erase_types[i].size == 0)
+      continue;
+    desc += " " + std::to_string(erase_types[i].size / 1024) + "K";
+  }
+  desc += ", reads up to " + std::to_string(max_read_khz / 1000) + "MHz";
+  if (io_modes & IO_QUAD) {
+    desc += " quad";
+  } else if (io_modes & IO_DUAL) {
+    desc += " dual";
+  }
+  return desc;
+}
+
+bool lookup(uint8_t mfgr, uint8_t device, FlashPart *out_part) {
+  for (const FlashPart &part : known_parts) {
+    if (part.mfgr == mfgr && part.device == device) {
+      *out_part = part;
+      return true;
+    }
+  }
+  return false;
+}
+
+FlashPart generic(uint8_t mfgr, uint8_t device) {
+  // For the common SPI NOR families the device ID encodes the capacity as
+  // log2(bytes) - 1, for 0x10 (128KiB) through 0x19 (64MiB)
+  uint32_t capacity = 0;
+  if (device >= 0x10 && device <= 0x19) {
+    capacity = 1u << (device + 1);
+  }
+
+  // Every part we've come across supports 4k erase and 256 byte pages, but
+  // assume the worst about how long things take.
+  FlashPart part{};
+  part.name = "unknown";
+  part.mfgr = mfgr;
+  part.device = device;
+  part.capacity = capacity;
+  part.page_size = 256;
+  part.erase_types[0] = EraseType{ERASE_4K, 50, 1000};
+  part.page_program_typ_us = 1000;
+  part.page_program_max_us = 5000;
+  // Plain 0x03 reads are only specified up to 50MHz on most parts
+  part.max_read_khz = 50000;
+  part.io_modes = IO_SINGLE;
+  return part;
+}
+
+static uint32_t read_le32(const std::vector<uint8_t> &data, size_t offset) {
+  return ((uint32_t)data[offset + 0] << 0) | ((uint32_t)data[offset + 1] << 8) |
+         ((uint32_t)data[offset + 2] << 16) |
+         ((uint32_t)data[offset + 3] << 24);
+}
+
+// Decode a JESD216 erase time field: a count plus a 2 bit units selector.
+static uint32_t sfdp_erase_time_ms(uint32_t count, uint32_t units) {
+  static const uint32_t unit_ms[] = {1, 16, 128, 1000};
+  return (count + 1) * unit_ms[units & 0x3];
+}
+
+bool apply_sfdp(const std::vector<uint8_t> &sfdp, FlashPart *part) {
+  // SFDP header is 8 bytes, followed by the first (mandatory) parameter
+  // header which describes the basic flash parameter table (BFPT)
+  if (sfdp.size() < 16)
+    return false;
+  if (read_le32(sfdp, 0) != 0x5044'4653) // 'SFDP'
+    return false;
+
+  const uint8_t bfpt_id = sfdp[8];
+  const uint8_t bfpt_dwords = sfdp[11];
+  const uint32_t bfpt_addr = sfdp[12] | (sfdp[13] << 8) | (sfdp[14] << 16);
+  if (bfpt_id != 0x00 || bfpt_dwords < 9)
+    return false;
+  if (bfpt_addr + bfpt_dwords * 4u > sfdp.size())
+    return false;
+  auto dword = [&](unsigned n) { // 1-indexed, as in the spec
+    return read_le32(sfdp, bfpt_addr + (n - 1) * 4);
+  };
+
+  // 1st DWORD: which multi-bit fast read modes are supported
+  FlashPart updated = *part;
+  const uint32_t fast_reads = dword(1);
+  updated.io_modes = IO_SINGLE;
+  if (fast_reads & (1 << 16)) // 1-1-2
+    updated.io_modes |= IO_DUAL;
+  if (fast_reads & (1 << 22)) // 1-1-4
+    updated.io_modes |= IO_QUAD;
+
+  // 2nd DWORD: density, either in bits - 1 or as a power of two of bits
+  const uint32_t density = dword(2);
+  if (density & 0x8000'0000) {
+    const uint32_t log2_bits = density & 0x7FFF'FFFF;
+    // Anything over 4GiB can't be addressed by our 32 bit commands anyway
+    updated.capacity =
+        (log2_bits < 3 || log2_bits >= 35) ? 0 : (1u << (log2_bits - 3));
+  } else {
+    updated.capacity = (density + 1) / 8;
+  }
+
+  // 8th and 9th DWORDs: erase types 1 through 4, as a size exponent and an
+  // opcode. Only keep those we have programmer commands for.
+  const uint32_t erase_dwords[] = {dword(8), dword(9)};
+  uint32_t erase_sizes[4];
+  for (unsigned i = 0; i < 4; i++) {
+    const uint8_t exponent = (erase_dwords[i / 2] >> ((i % 2) * 16)) & 0xFF;
+    erase_sizes[i] = (exponent == 0 || exponent > 31) ? 0 : (1u << exponent);
+  }
+
+  // 10th DWORD (JESD216A and later): erase timings
+  const bool have_erase_times = bfpt_dwords >= 10;
+  const uint32_t erase_times = have_erase_times ? dword(10) : 0;
+  const uint32_t erase_max_multiplier = 2 * ((erase_times & 0xF) + 1);
+
+  unsigned erase_slot = 0;
+  for (uint32_t wanted : {ERASE_4K, ERASE_32K, ERASE_64K}) {
+    for (unsigned i = 0; i < 4; i++) {
+      if (erase_sizes[i] != wanted)
+        continue;
+      EraseType type{wanted, 0, 0};
+      const EraseType *previous = part->erase_type(wanted);
+      if (have_erase_times) {
+        const uint32_t field = erase_times >> (4 + i * 7);
+        type.typ_ms = sfdp_erase_time_ms((field >> 0) & 0x1F, field >> 5);
+        type.max_ms = type.typ_ms * erase_max_multiplier;
+      } else if (previous != nullptr) {
+        type = *previous;
+      } else {
+        // No timing information at all, be pessimistic
+        type.typ_ms = 50 * (wanted / ERASE_4K);
+        type.max_ms = 1000 * (wanted / ERASE_4K);
+      }
+      updated.erase_types[erase_slot++] = type;
+      break;
+    }
+  }
+  if (erase_slot == 0)
+    return false;
+  for (; erase_slot < max_erase_types; erase_slot++) {
+    updated.erase_types[erase_slot] = EraseType{0, 0, 0};
+  }
+
+  // 11th DWORD: page size and program timing
+  if (bfpt_dwords >= 11) {
+    const uint32_t program = dword(11);
+    const uint32_t program_max_multiplier = 2 * ((program & 0xF) + 1);
+    updated.page_size = 1u << ((program >> 4) & 0xF);
+    const uint32_t page_count = (program >> 8) & 0x1F;
+    const uint32_t page_unit_us = (program & (1 << 13)) ? 64 : 8;
+    updated.page_program_typ_us = (page_count + 1) * page_unit_us;
+    updated.page_program_max_us =
+        updated.page_program_typ_us * program_max_multiplier;
+  }
+
+  *part = updated;
+  return true;
+}
+
+std::vector<EraseOp> plan_erase(const FlashPart &part, uint32_t start,
+                                uint32_t end) {
+  std::vector<EraseOp> plan;
+  const uint32_t min_size = part.min_erase_size();
+  if (min_size == 0 || end <= start)
+    return plan;
+
+  // Round out to the sectors that the range touches
+  uint64_t addr = start & ~(min_size - 1);
+  const uint64_t erase_end =
+      ((uint64_t)end + min_size - 1) & ~(uint64_t)(min_size - 1);
+
+  while (addr < erase_end) {
+    // Use the largest block that is aligned here and doesn't run past the
+    // end of the range
+    const EraseType *best = nullptr;
+    for (unsigned i = 0; i < max_erase_types; i++) {
+      const EraseType &type = part.erase_types[i];
+      if (type.size == 0 || (addr & (type.size - 1)) != 0)
+        continue;
+      if (addr + type.size > erase_end)
+        continue;
+      if (best == nullptr || type.size > best->size)
+        best = &type;
+    }
+    // Can't happen as min_size always fits, but don't spin if it does
+    if (best == nullptr)
+      break;
+    plan.push_back(EraseOp{(uint32_t)addr, best});
+    addr += best->size;
+  }
+
+  return plan;
+}
+
+} // namespace FlashParts
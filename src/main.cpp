@@ -1,251 +1,184 @@
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#include <libusb.h>
-
+#include <chrono>
 #include <memory>
 #include <string>
+#include <vector>
 
+#include <checksum.hpp>
 #include <cmdline.hpp>
-#include <usb_protocol.hpp>
-
-std::string get_serial_for_device(libusb_device_handle *handle) {
-  struct libusb_device_descriptor desc;
-  int ret = libusb_get_device_descriptor(libusb_get_device(handle), &desc);
-  if (ret < 0) {
-    fprintf(stderr, "Failed to read device descriptor\n");
-    return "";
-  }
-
-  char buf[256];
-  if (desc.iSerialNumber) {
-    ret = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
-                                             reinterpret_cast<uint8_t *>(buf),
-                                             sizeof(buf));
-    if (ret < 0) {
-      fprintf(stderr, "Failed to query serial descriptor\n");
-      return "";
-    }
-    return std::string(buf);
-  } else {
-    fprintf(stderr, "Device does not have a serial number\n");
-    return "";
-  }
-}
-
-std::string get_serial_for_device(libusb_device *dev) {
-  libusb_device_handle *handle;
-  int ret = libusb_open(dev, &handle);
-  if (ret < 0)
-    return "";
-  std::string serial = get_serial_for_device(handle);
-  libusb_close(handle);
-  return serial;
-}
-
-libusb_device_handle *get_device(CliArgs &args) {
-  // Get a list of all the USB devices in the system
-  libusb_device **devices;
-  ssize_t device_count = libusb_get_device_list(nullptr, &devices);
-
-  // Create a scoped pointer to free the list again
-  std::shared_ptr<void> _defer_free_device_list(
-      nullptr,
-      [=](...) { // Decref and free device list
-        libusb_free_device_list(devices, 1);
-      });
-
-  // Iterate the devices, and check if any of them have both the right VID:PID
-  // _and_ the right serial
-  for (ssize_t i = 0; i < device_count; i++) {
-    // Read the descriptor for this device
-    libusb_device_descriptor desc{};
-    int ret = libusb_get_device_descriptor(devices[i], &desc);
-    if (ret < 0) {
-      fprintf(stderr, "Failed to get device descriptor\n");
-      return nullptr;
-    }
-
-    // Is the VID:PID correct?
-    if (desc.idVendor != args._usb_vid || desc.idProduct != args._usb_pid)
-      continue;
-
-    // Open that device up
-    libusb_device_handle *handle;
-    ret = libusb_open(devices[i], &handle);
-    if (ret < 0) {
-      fprintf(stderr, "Failed to open device\n");
-      return nullptr;
-    }
-
-    // Do the arguments specify a device serial to use?
-    if (!args._usb_serial_specified) {
-      // Done, return the handle
-      return handle;
-    } else {
-      // Is the serial a match?
-      std::string device_serial = get_serial_for_device(handle);
-      if (!args._usb_serial.compare(device_serial)) {
-        return handle;
-      } else {
-        // Close it again, not a serial match
-        libusb_close(handle);
-      }
-    }
-  }
-
-  // Matching device not found
-  return nullptr;
-}
-
-void enumerate_devices(CliArgs &args) {
-  // Get a list of all the USB devices in the system
-  libusb_device **devices;
-  ssize_t device_count = libusb_get_device_list(nullptr, &devices);
-
-  // Create a scoped pointer to free the list again
-  std::shared_ptr<void> _defer_free_device_list(
-      nullptr,
-      [=](...) { // Decref and free device list
-        libusb_free_device_list(devices, 1);
-      });
+#include <faff.hpp>
+#include <trace.hpp>
 
+void enumerate_devices(Faff::Context &context, CliArgs &args) {
   fprintf(stderr, "Searching for devices with VID:PID %04x:%04x\n",
           args._usb_vid, args._usb_pid);
 
-  // Iterate the devices, and if they match VID:PID print their serial
-  unsigned devices_found = 0;
-  for (ssize_t i = 0; i < device_count; i++) {
-    // Read the descriptor for this device
-    libusb_device_descriptor desc{};
-    int ret = libusb_get_device_descriptor(devices[i], &desc);
-    if (ret < 0) {
-      fprintf(stderr, "Failed to get device descriptor: %s (%d)\n",
-              libusb_error_name(ret), ret);
-      exit(EXIT_FAILURE);
-    }
-
-    // Is the VID:PID correct?
-    if (desc.idVendor != args._usb_vid || desc.idProduct != args._usb_pid)
-      continue;
-
-    // Open that device up
-    libusb_device_handle *handle;
-    ret = libusb_open(devices[i], &handle);
-    if (ret < 0) {
-      fprintf(stderr, "Failed to open device: %s (%d)\n",
-              libusb_error_name(ret), ret);
-      continue;
-    }
-
-    // Get and print the serial
-    std::string device_serial = get_serial_for_device(handle);
-
-    fprintf(stderr, "[%u] Serial: %s\n", devices_found++,
-            device_serial.c_str());
+  // Print the serial of every device that matches VID:PID
+  std::vector<std::string> serials = context.enumerate(args);
+  for (size_t i = 0; i < serials.size(); i++) {
+    fprintf(stderr, "[%zu] Serial: %s\n", i, serials[i].c_str());
   }
 
-  if (devices_found) {
-    fprintf(stderr, "Found %u devices\n", devices_found);
+  if (!serials.empty()) {
+    fprintf(stderr, "Found %zu devices\n", serials.size());
   } else {
     fprintf(stderr, "Failed to find any devices\n");
   }
 }
 
-struct BitstreamFile {
-  BitstreamFile(uint8_t *data, off_t size) : _data(data), _size(size) {}
-  ~BitstreamFile() { munmap(_data, _size); }
-
-  uint8_t *_data;
-  off_t _size;
-};
-
-std::unique_ptr<BitstreamFile> open_bitstream(const char *file_path) {
-  // Open the file
-  int file_fd = open(file_path, O_RDONLY);
-
-  // If we failed to open, return nullptr
-  if (file_fd < 0) {
-    return nullptr;
+void print_progress(const Faff::Progress &progress) {
+  static const char *stage_names[] = {
+      "Erasing",
+      "Programming block",
+      "Verifying block",
+      "Reading block",
+  };
+  fprintf(stderr, "%s 0x%012" PRIx64 " / 0x%012" PRIx64 "\r",
+          stage_names[static_cast<int>(progress._stage)], progress._done,
+          progress._total);
+  if (progress._done == progress._total) {
+    fprintf(stderr, "\n");
   }
+}
 
-  // Defer closing the file again
-  std::shared_ptr<void> _defer_close_fd(nullptr, [=](...) { close(file_fd); });
-
-  // Get the file size
-  const off_t file_size = lseek(file_fd, 0, SEEK_END);
-  if (file_size < 0) {
-    return nullptr;
+void read_out_flash(Faff::Programmer &programmer, CliArgs &args) {
+  // Open the output file
+  int out_fd = open(args._read_out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out_fd < 0) {
+    throw Faff::Error(std::string("Failed to open output file '") +
+                      args._read_out_path + "': " + strerror(errno));
   }
-
-  // Move back to the start of the file
-  if (lseek(file_fd, 0, SEEK_SET) < 0) {
-    return nullptr;
+  std::shared_ptr<void> _defer_close_fd(nullptr, [=](...) { close(out_fd); });
+
+  // And the manifest, if requested
+  FILE *manifest = nullptr;
+  if (args._manifest_path != nullptr) {
+    manifest = fopen(args._manifest_path, "w");
+    if (manifest == nullptr) {
+      throw Faff::Error(std::string("Failed to open manifest file '") +
+                        args._manifest_path + "': " + strerror(errno));
+    }
   }
+  std::shared_ptr<void> _defer_close_manifest(nullptr, [&](...) {
+    if (manifest != nullptr)
+      fclose(manifest);
+  });
+
+  // Split each block we get back up on 4k sector boundaries for the sparse
+  // file and manifest handling.
+  const uint32_t sector_size = 4096;
+  uint32_t sectors_skipped = 0;
+  uint64_t length = 0;
+  auto sink = [&](uint32_t block_addr, const uint8_t *block,
+                  uint32_t block_size) {
+    for (uint32_t block_offset = 0; block_offset < block_size;) {
+      const uint32_t addr = block_addr + block_offset;
+      const uint32_t sector_end = (addr & ~(sector_size - 1)) + sector_size;
+      const uint32_t block_remaining = block_size - block_offset;
+      const uint32_t piece_size = (sector_end - addr) < block_remaining
+                                      ? (sector_end - addr)
+                                      : block_remaining;
+      const uint8_t *piece = &block[block_offset];
+      const bool erased = Checksum::is_erased(piece, piece_size);
+
+      if (manifest != nullptr &&
+          fprintf(manifest,
+                  "0x%08" PRIx32 " 0x%04" PRIx32 " 0x%08" PRIx32 "%s\n", addr,
+                  piece_size, Checksum::crc32(piece, piece_size),
+                  erased ? " erased" : "") < 0) {
+        throw Faff::Error(std::string("Failed to write manifest file: ") +
+                          strerror(errno));
+      }
 
-  // MMap up the data
-  void *mmapped_data = mmap(nullptr, // No addressing requirements
-                            file_size,
-                            PROT_READ,   // Read-only
-                            MAP_PRIVATE, // Do not share, do not change the file
-                            file_fd,     // File to map from
-                            0            // Offset 0
-  );
+      if (args._read_out_sparse && erased) {
+        // Skip over it, leaving a hole
+        if (lseek(out_fd, piece_size, SEEK_CUR) < 0) {
+          throw Faff::Error(std::string("Failed to seek output file: ") +
+                            strerror(errno));
+        }
+        sectors_skipped++;
+      } else {
+        for (uint32_t written = 0; written < piece_size;) {
+          ssize_t ret = write(out_fd, piece + written, piece_size - written);
+          if (ret < 0) {
+            throw Faff::Error(std::string("Failed to write output file: ") +
+                              strerror(errno));
+          }
+          written += ret;
+        }
+      }
 
-  // If mmap failed, return nullptr
-  if (mmapped_data == nullptr) {
-    return nullptr;
+      block_offset += piece_size;
+    }
+    length += block_size;
+  };
+
+  const auto start_time = std::chrono::steady_clock::now();
+  programmer
+      .read(args._file_lma, args._read_length_specified ? args._read_length : 0,
+            args, sink, print_progress)
+      .get();
+
+  // If the dump ended in a hole, nothing has extended the file out to its
+  // full size yet
+  if (ftruncate(out_fd, length) < 0) {
+    throw Faff::Error(std::string("Failed to set output file size: ") +
+                      strerror(errno));
   }
 
-  // Wrap up and return
-  return std::make_unique<BitstreamFile>(
-      reinterpret_cast<uint8_t *>(mmapped_data), file_size);
-}
-
-char nibble_to_hex(uint8_t nibble) {
-  if (nibble < 10) {
-    return '0' + nibble;
+  // The manifest is buffered, so a full disk may only show up here
+  if (manifest != nullptr) {
+    const int ret = fclose(manifest);
+    manifest = nullptr;
+    if (ret != 0) {
+      throw Faff::Error(std::string("Failed to write manifest file: ") +
+                        strerror(errno));
+    }
   }
-  return 'A' + (nibble - 10);
-}
 
-void byte_to_hex(uint8_t val, char *out_buf) {
-  out_buf[0] = nibble_to_hex((val >> 4) & 0xF);
-  out_buf[1] = nibble_to_hex((val >> 4) & 0xF);
+  const double elapsed_s = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start_time)
+                               .count();
+  fprintf(stderr, "Read 0x%08" PRIx64 " bytes in %.2fs (%.1f KiB/s)", length,
+          elapsed_s, elapsed_s > 0 ? (length / 1024.0) / elapsed_s : 0.0);
+  if (args._read_out_sparse) {
+    fprintf(stderr, ", %u erased sectors left sparse", sectors_skipped);
+  }
+  fprintf(stderr, "\n");
 }
 
-void print_binary_diff(uint8_t *expected, uint8_t *read, unsigned byte_count,
-                       uint32_t offset) {
-  // Two hex chars + space per byte, plus null terminator
-  const int char_count = (byte_count * 3) + 1;
-  char expected_str[char_count];
-  char read_str[char_count];
-
-  // Convert hex bytes
-  for (unsigned i = 0; i < byte_count; i++) {
-    byte_to_hex(expected[i], &expected_str[i * 3]);
-    expected_str[i * 3 + 2] = ' ';
-    byte_to_hex(read[i], &read_str[i * 3]);
-    read_str[i * 3 + 2] = ' ';
+void characterize(Faff::Programmer &programmer, CliArgs &args) {
+  const std::string path = Faff::tuning_profile_path(programmer.serial());
+  if (path.empty()) {
+    throw Faff::Error("Nowhere to save a tuning profile for this programmer");
   }
 
-  // Null terminate
-  expected_str[char_count - 1] = '\0';
-  read_str[char_count - 1] = '\0';
-
-  // Print diff
-  fprintf(stderr,
-          "Verify error for block of size %d at 0x%08x:\n"
-          "    Expected: %s\n"
-          "    Read:     %s\n",
-          byte_count, offset, expected_str, read_str);
+  Faff::Tuning tuning =
+      programmer
+          .characterize(args, args._scratch_specified ? args._scratch_addr
+                                                      : Faff::scratch_at_end)
+          .get();
+  Faff::save_tuning(path, tuning,
+                    "faff tuning profile for " + programmer.serial() +
+                        ", written by faff --characterize");
+
+  fprintf(stderr, "Saved tuning profile to %s:\n", path.c_str());
+  fprintf(stderr, "    Command timeout:     %ums\n", tuning.command_timeout_ms);
+  fprintf(stderr, "    Bulk timeout:        +%uus per KiB\n",
+          tuning.bulk_timeout_us_per_kib);
+  fprintf(stderr, "    Status poll:         every %uus\n",
+          tuning.poll_interval_us);
+  fprintf(stderr, "    Write chunk:         %u bytes\n", tuning.write_chunk);
+  fprintf(stderr, "    Read block:          %u bytes\n", tuning.read_block);
 }
 
 int main(int argc, char **argv) {
@@ -258,152 +191,68 @@ int main(int argc, char **argv) {
     return EXIT_SUCCESS;
   }
 
-  // Attempt to init libusb
-  if (libusb_init(NULL) < 0) {
-    fprintf(stderr, "Failed to initialize libusb\n");
-    return EXIT_FAILURE;
-  }
-
-  // If we are in enumerate only mode, print available devices and exit
-  if (args._enumerate_only) {
-    enumerate_devices(args);
-    return EXIT_SUCCESS;
-  }
-
-  // If we didn't short circuit for help, and the args are invalid, error out
-  if (!args.valid()) {
-    args.report_errors();
-    fprintf(stderr, "To view help, ruh %s -h\n", argv[0]);
-    return EXIT_FAILURE;
-  }
-
-  // Try and open the file we're trying to program
-  std::unique_ptr<BitstreamFile> file = open_bitstream(args._file_path);
-  if (file == nullptr) {
-    fprintf(stderr, "Failed to open bitstream file '%s'\n", args._file_path);
-    return EXIT_FAILURE;
-  }
-
-  // Try and open USB device
-  libusb_device_handle *usb_handle = get_device(args);
-  if (usb_handle == nullptr) {
-    fprintf(stderr, "Failed to find device with VID:PID %04x:%04x\n",
-            args._usb_vid, args._usb_pid);
-    return EXIT_FAILURE;
-  }
-
-  // Claim programming interface
-  if (libusb_claim_interface(usb_handle, args._usb_interface) < 0) {
-    fprintf(stderr, "Failed to claim usb interface 0x%02" PRIx16 "\n",
-            args._usb_interface);
-    return EXIT_FAILURE;
-  }
-
-  // Get the serial for this device
-  std::string serial = get_serial_for_device(usb_handle);
-  fprintf(stderr, "Claimed device %04" PRIx16 ":%04" PRIx16 " with serial %s\n",
-          args._usb_vid, args._usb_pid, serial.c_str());
+  try {
+    // Attempt to init libusb
+    Faff::Context context;
 
-  // Wrap it in a protocol layer
-  UsbProto::Session session(usb_handle, args);
-
-  // Disable the target FPGA so that we can control the SPI flash
-  session.cmd_fpga_reset_assert();
-  session.cmd_set_rgb_led(0, 128, 0);
-
-  // Verify we are now in programming mode
-  if (!session.fpga_is_under_reset()) {
-    fprintf(stderr, "Failed to assert FPGA reset\n");
-    return EXIT_FAILURE;
-  }
-
-  // Get the flash chip ID
-  uint8_t flash_mfgr, flash_device;
-  uint64_t flash_unique_id;
-  session.cmd_flash_identify(&flash_mfgr, &flash_device, &flash_unique_id);
-  fprintf(stderr,
-          "Flash chip mfgr: 0x%02" PRIx16 ", Device ID: 0x%02" PRIx16
-          " Unique ID: 0x%016" PRIx64 "\n",
-          flash_mfgr, flash_device, flash_unique_id);
-
-  // Indicator LED to yellow for act
-  session.cmd_set_rgb_led(64, 32, 0);
-
-  // Start writing the flash. Every time we touch a new 4k sector, we need to
-  // erase it before we can write it.
-  uint32_t previous_sector = 0xFFFF'FFFF;
-  // TODO(ross): respect the LMA option
-  // unsigned _file_lma = 0x0;
-  for (unsigned byte_offset = 0; byte_offset < file->_size;) {
-    // Mask off the sector bits
-    uint32_t sector = (args._file_lma + byte_offset) & 0xFF'FF'F0'00;
-    if (sector != previous_sector) {
-      // Start the erase operation
-      session.cmd_flash_erase_4k(sector);
-      // Wait for erase complete
-      do {
-        usleep(5'000);
-      } while (session.flash_busy());
-      // Update the prev sector value
-      previous_sector = sector;
+    // If we are in enumerate only mode, print available devices and exit
+    if (args._enumerate_only) {
+      enumerate_devices(context, args);
+      return EXIT_SUCCESS;
     }
 
-    // USB FS max packet size is 64 bytes. We have some overhead, so biggest
-    // power of 2 is 32.
-    uint8_t data[32];
-    size_t bytes_to_copy = ((long)sizeof(data)) < (file->_size - byte_offset)
-                               ? sizeof(data)
-                               : (file->_size - byte_offset);
-    memcpy(data, &file->_data[byte_offset], bytes_to_copy);
-    fprintf(stderr, "Programming block 0x%012" PRIx32 " / 0x%012lx\r",
-            args._file_lma + byte_offset, args._file_lma + file->_size);
-    session.cmd_flash_write(args._file_lma + byte_offset, data, bytes_to_copy);
-
-    // Increment byte offset
-    byte_offset += bytes_to_copy;
-
-    // Wait for write in progress bit to clear again
-    do {
-      usleep(1'000);
-    } while (session.flash_busy());
-  }
-  fprintf(stderr, "\n");
-
-  // If it wasn't disabled, perform a re-read of the flash to verify
-  if (args._verify_programmed) {
-    for (unsigned byte_offset = 0; byte_offset < file->_size;) {
-      uint8_t data[32];
-      size_t bytes_to_copy = ((long)sizeof(data)) < (file->_size - byte_offset)
-                                 ? sizeof(data)
-                                 : (file->_size - byte_offset);
-      fprintf(stderr, "Reading block 0x%012" PRIx32 " / 0x%012lx\r",
-              args._file_lma + byte_offset, args._file_lma + file->_size);
-      session.cmd_flash_read(args._file_lma + byte_offset, data, bytes_to_copy);
+    // If we didn't short circuit for help, and the args are invalid, error out
+    if (!args.valid()) {
+      args.report_errors();
+      fprintf(stderr, "To view help, ruh %s -h\n", argv[0]);
+      return EXIT_FAILURE;
+    }
 
-      // Compare the read block with the real bitstream
-      if (memcmp(data, &file->_data[byte_offset], bytes_to_copy) != 0) {
-        print_binary_diff(&file->_data[byte_offset], data, bytes_to_copy,
-                          byte_offset);
+    // Try and open the file we're trying to program
+    std::shared_ptr<Faff::BitstreamFile> file;
+    if (args._file_path != nullptr) {
+      file = Faff::open_bitstream(args._file_path);
+      if (file == nullptr) {
+        fprintf(stderr, "Failed to open bitstream file '%s'\n",
+                args._file_path);
         return EXIT_FAILURE;
       }
+    }
 
-      // Increment byte offset
-      byte_offset += bytes_to_copy;
+    // Per-board patches from a file go after any from the command line
+    if (args._patches_path != nullptr) {
+      std::vector<Faff::Patch> patches = Faff::load_patches(args._patches_path);
+      args._patches.insert(args._patches.end(), patches.begin(),
+                           patches.end());
     }
-    fprintf(stderr, "\n");
-  }
 
-  // Release the FPGA
-  session.cmd_fpga_reset_deassert();
+    // Try and open USB device
+    std::unique_ptr<Faff::Programmer> programmer = context.open(args);
+    fprintf(stderr,
+            "Claimed device %04" PRIx16 ":%04" PRIx16 " with serial %s\n",
+            args._usb_vid, args._usb_pid, programmer->serial().c_str());
+
+    std::shared_ptr<Trace::Writer> trace;
+    if (args._trace_path != nullptr) {
+      trace = std::make_shared<Trace::Writer>(args._trace_path);
+      programmer->session().set_trace(trace);
+    }
 
-  // Verify we have properly released
-  if (session.fpga_is_under_reset()) {
-    fprintf(stderr, "Failed to release FPGA reset\n");
+    if (args._read_out_path != nullptr) {
+      read_out_flash(*programmer, args);
+    } else if (args._characterize) {
+      characterize(*programmer, args);
+    } else {
+      programmer->program(file, args, print_progress).get();
+    }
+
+    if (trace != nullptr) {
+      trace->close();
+    }
+  } catch (const Faff::Error &e) {
+    fprintf(stderr, "\n%s\n", e.what());
     return EXIT_FAILURE;
   }
 
-  // Idle led to low green
-  session.cmd_set_rgb_led(0, 16, 0);
-
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,49 @@
+#include <string.h>
+
+#include <multiboot.hpp>
+
+namespace Multiboot {
+
+// Each entry is a tiny bitstream: sync word, boot mode, boot address, bank
+// offset and reboot commands, zero padded to 32 bytes.
+static const uint8_t sync_word[] = {0x7E, 0xAA, 0x99, 0x7E};
+static const uint8_t boot_address_command[] = {0x44, 0x03};
+
+// Offset of the 24 bit boot address within an entry, or -1 if the entry
+// doesn't look like one
+static int address_offset(const uint8_t *entry) {
+  if (memcmp(entry, sync_word, sizeof(sync_word)) != 0)
+    return -1;
+  for (unsigned i = sizeof(sync_word); i + 5 <= entry_size; i++) {
+    if (memcmp(&entry[i], boot_address_command,
+               sizeof(boot_address_command)) == 0)
+      return i + sizeof(boot_address_command);
+  }
+  return -1;
+}
+
+bool parse(const uint8_t *data, size_t size, uint32_t out_addrs[entry_count]) {
+  if (size < header_size)
+    return false;
+
+  for (unsigned i = 0; i < entry_count; i++) {
+    const uint8_t *entry = &data[i * entry_size];
+    const int offset = address_offset(entry);
+    if (offset < 0)
+      return false;
+    out_addrs[i] = ((((uint32_t)entry[offset + 0]) << 16) |
+                    (((uint32_t)entry[offset + 1]) << 8) |
+                    (((uint32_t)entry[offset + 2]) << 0));
+  }
+  return true;
+}
+
+void set_entry(uint8_t *data, unsigned index, uint32_t addr) {
+  uint8_t *entry = &data[index * entry_size];
+  const int offset = address_offset(entry);
+  entry[offset + 0] = (uint8_t)(addr >> 16);
+  entry[offset + 1] = (uint8_t)(addr >> 8);
+  entry[offset + 2] = (uint8_t)(addr >> 0);
+}
+
+} // namespace Multiboot
@@ -0,0 +1,173 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <memory>
+
+#include <error.hpp>
+#include <patch.hpp>
+
+namespace Faff {
+
+static bool parse_encoding(const std::string &name,
+                           Patch::Encoding *out_encoding) {
+  if (name == "hex") {
+    *out_encoding = Patch::Encoding::HEX;
+  } else if (name == "text") {
+    *out_encoding = Patch::Encoding::TEXT;
+  } else if (name == "file") {
+    *out_encoding = Patch::Encoding::FILE;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool parse_offset(const std::string &text, uint32_t *out_offset) {
+  char *end;
+  errno = 0;
+  const unsigned long long offset = strtoull(text.c_str(), &end, 0);
+  if (text.empty() || *end != '\0' || errno != 0 || offset > UINT32_MAX)
+    return false;
+  *out_offset = offset;
+  return true;
+}
+
+Patch parse_patch(const std::string &spec) {
+  const size_t offset_end = spec.find(':');
+  const size_t encoding_end = offset_end == std::string::npos
+                                  ? std::string::npos
+                                  : spec.find(':', offset_end + 1);
+  Patch patch;
+  if (encoding_end == std::string::npos ||
+      !parse_offset(spec.substr(0, offset_end), &patch.offset) ||
+      !parse_encoding(
+          spec.substr(offset_end + 1, encoding_end - offset_end - 1),
+          &patch.encoding)) {
+    throw Error("Bad patch '" + spec +
+                "', expected <offset>:<hex|text|file>:<value>");
+  }
+  patch.value = spec.substr(encoding_end + 1);
+  return patch;
+}
+
+std::vector<Patch> load_patches(const char *path) {
+  FILE *in = fopen(path, "r");
+  if (in == nullptr) {
+    throw Error(std::string("Failed to open patch file '") + path +
+                "': " + strerror(errno));
+  }
+  std::shared_ptr<void> _defer_close(nullptr, [=](...) { fclose(in); });
+
+  std::vector<Patch> patches;
+  char line[1024];
+  unsigned line_number = 0;
+  while (fgets(line, sizeof(line), in) != nullptr) {
+    line_number++;
+    line[strcspn(line, "\r\n")] = '\0';
+    char offset[32];
+    char encoding[16];
+    int value_start = 0;
+    if (line[0] == '#' || sscanf(line, "%31s", offset) != 1)
+      continue;
+
+    Patch patch;
+    if (sscanf(line, "%31s %15s %n", offset, encoding, &value_start) < 2 ||
+        value_start == 0 || !parse_offset(offset, &patch.offset) ||
+        !parse_encoding(encoding, &patch.encoding)) {
+      throw Error(std::string("Patch file '") + path + "' line " +
+                  std::to_string(line_number) +
+                  ": expected <offset> <hex|text|file> <value>");
+    }
+    patch.value = &line[value_start];
+    patches.push_back(patch);
+  }
+  return patches;
+}
+
+std::string substitute(const std::string &text,
+                       const PatchVariables &variables) {
+  std::string result;
+  size_t pos = 0;
+  for (;;) {
+    const size_t start = text.find("${", pos);
+    if (start == std::string::npos)
+      break;
+    const size_t end = text.find('}', start);
+    if (end == std::string::npos) {
+      throw Error("Unterminated variable in '" + text + "'");
+    }
+    const std::string name = text.substr(start + 2, end - start - 2);
+    auto it = variables.find(name);
+    if (it == variables.end()) {
+      throw Error("Unknown variable ${" + name + "} in '" + text + "'");
+    }
+    result += text.substr(pos, start - pos) + it->second;
+    pos = end + 1;
+  }
+  return result + text.substr(pos);
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+std::vector<uint8_t> patch_bytes(const Patch &patch,
+                                 const PatchVariables &variables) {
+  const std::string value = substitute(patch.value, variables);
+  std::vector<uint8_t> bytes;
+
+  switch (patch.encoding) {
+  case Patch::Encoding::HEX: {
+    int high = -1;
+    for (char c : value) {
+      if (c == ' ' || c == ':')
+        continue;
+      const int nibble = hex_value(c);
+      if (nibble < 0) {
+        throw Error("Bad hex patch value '" + value + "'");
+      }
+      if (high < 0) {
+        high = nibble;
+      } else {
+        bytes.push_back((high << 4) | nibble);
+        high = -1;
+      }
+    }
+    if (high >= 0) {
+      throw Error("Hex patch value '" + value + "' has an odd digit count");
+    }
+    break;
+  }
+  case Patch::Encoding::TEXT:
+    bytes.assign(value.begin(), value.end());
+    break;
+  case Patch::Encoding::FILE: {
+    FILE *in = fopen(value.c_str(), "rb");
+    if (in == nullptr) {
+      throw Error("Failed to open patch data '" + value +
+                  "': " + strerror(errno));
+    }
+    std::shared_ptr<void> _defer_close(nullptr, [=](...) { fclose(in); });
+    uint8_t buf[4096];
+    size_t count;
+    while ((count = fread(buf, 1, sizeof(buf), in)) > 0) {
+      bytes.insert(bytes.end(), buf, buf + count);
+    }
+    if (ferror(in)) {
+      throw Error("Failed to read patch data '" + value + "'");
+    }
+    break;
+  }
+  }
+  return bytes;
+}
+
+} // namespace Faff
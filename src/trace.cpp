@@ -0,0 +1,136 @@
+#include <errno.h>
+#include <string.h>
+
+#include <memory>
+
+#include <error.hpp>
+#include <trace.hpp>
+
+namespace Trace {
+
+static void put_u32(uint8_t *out, uint32_t value) {
+  out[0] = (uint8_t)(value >> 24);
+  out[1] = (uint8_t)(value >> 16);
+  out[2] = (uint8_t)(value >> 8);
+  out[3] = (uint8_t)(value >> 0);
+}
+
+static void put_u64(uint8_t *out, uint64_t value) {
+  put_u32(&out[0], (uint32_t)(value >> 32));
+  put_u32(&out[4], (uint32_t)(value >> 0));
+}
+
+static uint32_t get_u32(const uint8_t *in) {
+  return ((((uint32_t)in[0]) << 24) | (((uint32_t)in[1]) << 16) |
+          (((uint32_t)in[2]) << 8) | (((uint32_t)in[3]) << 0));
+}
+
+static uint64_t get_u64(const uint8_t *in) {
+  return (((uint64_t)get_u32(&in[0])) << 32) | get_u32(&in[4]);
+}
+
+Writer::Writer(const char *path) : _start(std::chrono::steady_clock::now()) {
+  _file = fopen(path, "wb");
+  if (_file == nullptr) {
+    throw Faff::Error(std::string("Failed to open trace file '") + path +
+                      "': " + strerror(errno));
+  }
+  // Records are small and frequent, so buffer them up generously
+  setvbuf(_file, nullptr, _IOFBF, 1 << 16);
+
+  const uint64_t start_unix_ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count();
+  uint8_t header[header_size];
+  memcpy(header, file_magic, sizeof(file_magic));
+  put_u64(&header[8], start_unix_ns);
+  if (fwrite(header, sizeof(header), 1, _file) != 1) {
+    _failed = true;
+  }
+}
+
+Writer::~Writer() {
+  if (_file != nullptr)
+    fclose(_file);
+}
+
+uint64_t Writer::now_ns() const {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - _start)
+      .count();
+}
+
+void Writer::write(const Record &record) {
+  uint8_t out[record_size];
+  put_u64(&out[0], record.start_ns);
+  put_u32(&out[8], record.duration_ns);
+  out[12] = static_cast<uint8_t>(record.kind);
+  out[13] = record.endpoint;
+  out[14] = record.opcode;
+  out[15] = record.status;
+  put_u32(&out[16], (uint32_t)record.result);
+  put_u32(&out[20], record.addr);
+  put_u32(&out[24], record.length);
+  put_u32(&out[28], record.transferred);
+  put_u32(&out[32], record.timeout_ms);
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_file == nullptr || _failed)
+    return;
+  if (fwrite(out, sizeof(out), 1, _file) != 1) {
+    _failed = true;
+  }
+}
+
+void Writer::close() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_file == nullptr)
+    return;
+  if (fclose(_file) != 0) {
+    _failed = true;
+  }
+  _file = nullptr;
+  if (_failed) {
+    throw Faff::Error("Failed to write trace file");
+  }
+}
+
+File read(const char *path) {
+  FILE *in = fopen(path, "rb");
+  if (in == nullptr) {
+    throw Faff::Error(std::string("Failed to open trace file '") + path +
+                      "': " + strerror(errno));
+  }
+  std::shared_ptr<void> _defer_close(nullptr, [=](...) { fclose(in); });
+
+  uint8_t header[header_size];
+  if (fread(header, sizeof(header), 1, in) != 1 ||
+      memcmp(header, file_magic, sizeof(file_magic)) != 0) {
+    throw Faff::Error(std::string("'") + path + "' is not a faff trace");
+  }
+
+  File file;
+  file.start_unix_ns = get_u64(&header[8]);
+  uint8_t raw[record_size];
+  while (fread(raw, sizeof(raw), 1, in) == 1) {
+    Record record;
+    record.start_ns = get_u64(&raw[0]);
+    record.duration_ns = get_u32(&raw[8]);
+    record.kind = static_cast<Kind>(raw[12]);
+    record.endpoint = raw[13];
+    record.opcode = raw[14];
+    record.status = raw[15];
+    record.result = (int32_t)get_u32(&raw[16]);
+    record.addr = get_u32(&raw[20]);
+    record.length = get_u32(&raw[24]);
+    record.transferred = get_u32(&raw[28]);
+    record.timeout_ms = get_u32(&raw[32]);
+    file.records.push_back(record);
+  }
+  // A trace cut short by a crash may end in a partial record, which we
+  // just drop
+  return file;
+}
+
+} // namespace Trace
@@ -0,0 +1,428 @@
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <error.hpp>
+#include <trace.hpp>
+#include <usb_protocol.hpp>
+
+// faff-trace: offline analysis of traces recorded with `faff --trace`
+
+static void usage() {
+  /* clang-format off */
+fprintf(stderr, "faff-trace: Inspect faff USB transfer traces\n"
+"Usage:\n"
+"    faff-trace summary <trace>\n"
+"        Per opcode transfer counts and latencies, and how much of the run\n"
+"        was spent in transfers, waiting on the device and on the host\n"
+"    faff-trace chrome <trace> <out.json>\n"
+"        Convert to Chrome trace JSON, for chrome://tracing or Perfetto\n"
+"    faff-trace replay <trace> [options]\n"
+"        Replay the trace's transfers against a simulated device and compare\n"
+"        the timing with the recording. Without --model the device latencies\n"
+"        are fitted from the replayed trace itself.\n"
+"        --model <trace>         Take device latencies from this trace\n"
+"                                instead, e.g. one from a known good machine\n"
+"        --host-gap-scale <x>    Scale the host's time between transfers by\n"
+"                                x >= 0, e.g. 0 to see the run with no host\n"
+"                                overhead. Waits on the device are kept.\n"
+"        --chrome <out.json>     Also write the replayed timeline\n"
+);
+  /* clang-format on */
+}
+
+static const char *event_name(uint8_t type) {
+  switch (static_cast<UsbProto::EventType>(type)) {
+  case UsbProto::EventType::FLASH_IDLE:
+    return "FLASH_IDLE";
+  case UsbProto::EventType::SECTOR_JOB_DONE:
+    return "SECTOR_JOB_DONE";
+  }
+  return "UNKNOWN_EVENT";
+}
+
+static const char *record_name(const Trace::Record &record) {
+  if (record.kind == Trace::Kind::EVENT)
+    return event_name(record.opcode);
+  return UsbProto::opcode_name(record.opcode);
+}
+
+static const char *kind_name(Trace::Kind kind) {
+  switch (kind) {
+  case Trace::Kind::COMMAND:
+    return "cmd";
+  case Trace::Kind::RESPONSE:
+    return "resp";
+  case Trace::Kind::EVENT:
+    return "event";
+  }
+  return "?";
+}
+
+// True if the gap before `record` was spent waiting on the device rather than
+// on the host: the wait for a completion event, or the sleep before a status
+// poll. These gaps are flash busy time, so a faster host wouldn't shorten them.
+static bool ends_device_wait(const Trace::Record &record) {
+  if (record.kind == Trace::Kind::EVENT)
+    return true;
+  if (record.kind != Trace::Kind::COMMAND)
+    return false;
+  switch (static_cast<UsbProto::Opcode>(record.opcode)) {
+  case UsbProto::Opcode::FLASH_QUERY_STATUS:
+  case UsbProto::Opcode::SECTOR_JOB_STATUS:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Where the time between the start of the first record and the end of the
+// last one went
+struct TimeBreakdown {
+  uint64_t total_ns = 0;
+  // Inside libusb transfers
+  uint64_t transfer_ns = 0;
+  // Gaps that ended with a completion event or a status poll, i.e. waiting on
+  // the flash
+  uint64_t device_wait_ns = 0;
+  // Every other gap, i.e. host processing
+  uint64_t host_gap_ns = 0;
+};
+
+static TimeBreakdown breakdown(const std::vector<Trace::Record> &records) {
+  TimeBreakdown times;
+  if (records.empty())
+    return times;
+
+  uint64_t prev_end = records.front().start_ns;
+  for (const Trace::Record &record : records) {
+    const uint64_t gap =
+        record.start_ns > prev_end ? record.start_ns - prev_end : 0;
+    if (ends_device_wait(record)) {
+      times.device_wait_ns += gap;
+    } else {
+      times.host_gap_ns += gap;
+    }
+    times.transfer_ns += record.duration_ns;
+    prev_end = std::max(prev_end, record.end_ns());
+  }
+  times.total_ns = prev_end - records.front().start_ns;
+  return times;
+}
+
+static void print_breakdown(const char *title, const TimeBreakdown &times) {
+  const double total = times.total_ns > 0 ? times.total_ns : 1;
+  fprintf(stderr, "%s: %.3f s\n", title, times.total_ns / 1e9);
+  fprintf(stderr, "    In transfers:      %9.3f s (%5.1f%%)\n",
+          times.transfer_ns / 1e9, 100.0 * times.transfer_ns / total);
+  fprintf(stderr, "    Waiting on device: %9.3f s (%5.1f%%)\n",
+          times.device_wait_ns / 1e9, 100.0 * times.device_wait_ns / total);
+  fprintf(stderr, "    Host gaps:         %9.3f s (%5.1f%%)\n",
+          times.host_gap_ns / 1e9, 100.0 * times.host_gap_ns / total);
+}
+
+using RecordKey = std::pair<Trace::Kind, uint8_t>;
+
+static int summary(const Trace::File &trace) {
+  struct Stats {
+    uint64_t bytes = 0;
+    uint64_t total_ns = 0;
+    unsigned errors = 0;
+    std::vector<uint32_t> durations_ns;
+  };
+  std::map<RecordKey, Stats> stats;
+  for (const Trace::Record &record : trace.records) {
+    Stats &entry = stats[RecordKey(record.kind, record.opcode)];
+    entry.bytes += record.transferred;
+    entry.total_ns += record.duration_ns;
+    entry.errors += record.result < 0;
+    entry.durations_ns.push_back(record.duration_ns);
+  }
+
+  const time_t start_s = trace.start_unix_ns / 1000000000;
+  fprintf(stderr, "%zu records, recorded %s", trace.records.size(),
+          ctime(&start_s));
+  print_breakdown("Run time", breakdown(trace.records));
+
+  fprintf(stderr, "\n%-20s %-5s %8s %10s %10s %9s %9s %9s %6s\n", "opcode",
+          "dir", "count", "bytes", "total ms", "mean us", "p50 us", "max us",
+          "errors");
+  for (auto &entry : stats) {
+    Stats &s = entry.second;
+    std::sort(s.durations_ns.begin(), s.durations_ns.end());
+    const size_t count = s.durations_ns.size();
+    const char *name = entry.first.first == Trace::Kind::EVENT
+                           ? event_name(entry.first.second)
+                           : UsbProto::opcode_name(entry.first.second);
+    fprintf(stderr,
+            "%-20s %-5s %8zu %10" PRIu64 " %10.3f %9.1f %9.1f %9.1f %6u\n",
+            name, kind_name(entry.first.first), count, s.bytes,
+            s.total_ns / 1e6, s.total_ns / 1e3 / count,
+            s.durations_ns[count / 2] / 1e3, s.durations_ns.back() / 1e3,
+            s.errors);
+  }
+  return EXIT_SUCCESS;
+}
+
+static bool write_chrome(const char *path,
+                         const std::vector<Trace::Record> &records) {
+  FILE *out = fopen(path, "w");
+  if (out == nullptr) {
+    fprintf(stderr, "Failed to open '%s': %s\n", path, strerror(errno));
+    return false;
+  }
+
+  // One track each for commands, responses and events
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  static const char *track_names[] = {"Commands", "Responses", "Events"};
+  for (int tid = 0; tid < 3; tid++) {
+    fprintf(out,
+            "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+            "\"args\":{\"name\":\"%s\"}},\n",
+            tid + 1, track_names[tid]);
+  }
+  for (size_t i = 0; i < records.size(); i++) {
+    const Trace::Record &record = records[i];
+    const int tid = static_cast<int>(record.kind) + 1;
+    if (record.kind == Trace::Kind::EVENT) {
+      fprintf(out,
+              "{\"name\":\"%s\",\"cat\":\"event\",\"ph\":\"i\",\"s\":\"t\","
+              "\"ts\":%.3f,\"pid\":1,\"tid\":%d,"
+              "\"args\":{\"addr\":\"0x%08" PRIx32 "\",\"status\":%u}}",
+              record_name(record), record.start_ns / 1e3, tid, record.addr,
+              record.status);
+    } else {
+      fprintf(out,
+              "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+              "\"dur\":%.3f,\"pid\":1,\"tid\":%d,"
+              "\"args\":{\"addr\":\"0x%08" PRIx32 "\",\"length\":%" PRIu32
+              ",\"transferred\":%" PRIu32 ",\"result\":%" PRId32 "}}",
+              record_name(record), kind_name(record.kind),
+              record.start_ns / 1e3, record.duration_ns / 1e3, tid,
+              record.addr, record.length, record.transferred, record.result);
+    }
+    fprintf(out, "%s\n", i + 1 < records.size() ? "," : "");
+  }
+  fprintf(out, "]}\n");
+
+  if (fclose(out) != 0) {
+    fprintf(stderr, "Failed to write '%s'\n", path);
+    return false;
+  }
+  return true;
+}
+
+// Simulated device: predicts how long a transfer takes from its direction,
+// opcode and size, using a least squares fit of latency + per byte cost over
+// the successful transfers in a trace.
+class DeviceModel {
+public:
+  explicit DeviceModel(const std::vector<Trace::Record> &records) {
+    struct Sums {
+      double n = 0, x = 0, y = 0, xx = 0, xy = 0;
+    };
+    std::map<RecordKey, Sums> sums;
+    for (const Trace::Record &record : records) {
+      if (record.kind == Trace::Kind::EVENT || record.result < 0)
+        continue;
+      Sums &s = sums[RecordKey(record.kind, record.opcode)];
+      const double x = record.length, y = record.duration_ns;
+      s.n += 1;
+      s.x += x;
+      s.y += y;
+      s.xx += x * x;
+      s.xy += x * y;
+    }
+
+    for (auto &entry : sums) {
+      const Sums &s = entry.second;
+      Fit fit;
+      const double denominator = s.n * s.xx - s.x * s.x;
+      if (denominator > 0) {
+        fit.per_byte_ns = std::max(0.0, (s.n * s.xy - s.x * s.y) / denominator);
+      }
+      fit.base_ns = std::max(0.0, (s.y - fit.per_byte_ns * s.x) / s.n);
+      _fits[entry.first] = fit;
+    }
+  }
+
+  // False if the model has never seen this kind of transfer
+  bool predict(const Trace::Record &record, uint32_t *out_duration_ns) const {
+    auto it = _fits.find(RecordKey(record.kind, record.opcode));
+    if (it == _fits.end())
+      return false;
+    *out_duration_ns =
+        (uint32_t)(it->second.base_ns + it->second.per_byte_ns * record.length);
+    return true;
+  }
+
+private:
+  struct Fit {
+    double base_ns = 0;
+    double per_byte_ns = 0;
+  };
+  std::map<RecordKey, Fit> _fits;
+};
+
+// Issue the recorded transfers in order against `model`, keeping the host's
+// gaps between them (scaled) and the recorded waits on the device.
+// Failed transfers keep their recorded duration, since a timeout costs the
+// same on any device.
+static std::vector<Trace::Record>
+replay(const std::vector<Trace::Record> &records, const DeviceModel &model,
+       double host_gap_scale) {
+  std::vector<Trace::Record> replayed;
+  replayed.reserve(records.size());
+  if (records.empty())
+    return replayed;
+
+  uint64_t clock_ns = 0;
+  uint64_t prev_end = records.front().start_ns;
+  for (const Trace::Record &record : records) {
+    const uint64_t gap =
+        record.start_ns > prev_end ? record.start_ns - prev_end : 0;
+    clock_ns +=
+        ends_device_wait(record) ? gap : (uint64_t)(gap * host_gap_scale);
+    prev_end = std::max(prev_end, record.end_ns());
+
+    Trace::Record simulated = record;
+    simulated.start_ns = clock_ns;
+    if (record.kind != Trace::Kind::EVENT && record.result >= 0) {
+      model.predict(record, &simulated.duration_ns);
+    }
+    clock_ns += simulated.duration_ns;
+    replayed.push_back(simulated);
+  }
+  return replayed;
+}
+
+static int replay_command(int argc, char **argv) {
+  const char *model_path = nullptr;
+  const char *chrome_path = nullptr;
+  double host_gap_scale = 1.0;
+
+  static const struct option replay_options[] = {
+      {.name = "model",
+       .has_arg = required_argument,
+       .flag = nullptr,
+       .val = 'm'},
+      {.name = "host-gap-scale",
+       .has_arg = required_argument,
+       .flag = nullptr,
+       .val = 's'},
+      {.name = "chrome",
+       .has_arg = required_argument,
+       .flag = nullptr,
+       .val = 'c'},
+      // Final value must be sentinel
+      {0, 0, 0, 0},
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "", replay_options, nullptr)) != -1) {
+    if (c == 'm') {
+      model_path = optarg;
+    } else if (c == 's') {
+      char *end;
+      host_gap_scale = strtod(optarg, &end);
+      if (end == optarg || *end != '\0' || !isfinite(host_gap_scale) ||
+          host_gap_scale < 0) {
+        fprintf(stderr, "Invalid --host-gap-scale '%s'\n", optarg);
+        return EXIT_FAILURE;
+      }
+    } else if (c == 'c') {
+      chrome_path = optarg;
+    } else {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 1) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  const Trace::File trace = Trace::read(argv[optind]);
+  const DeviceModel model(model_path != nullptr
+                              ? Trace::read(model_path).records
+                              : trace.records);
+  const std::vector<Trace::Record> replayed =
+      replay(trace.records, model, host_gap_scale);
+
+  if (model_path != nullptr) {
+    fprintf(stderr, "Device model fitted from %s\n", model_path);
+  } else {
+    // The replayed transfers then only differ from the recording by the
+    // fit's error, so only the gap scaling says anything
+    fprintf(stderr, "Device model self-fitted from %s, pass --model to "
+                    "compare against another trace\n",
+            argv[optind]);
+  }
+
+  const TimeBreakdown recorded_times = breakdown(trace.records);
+  const TimeBreakdown replayed_times = breakdown(replayed);
+  print_breakdown("Recorded", recorded_times);
+  print_breakdown("Replayed", replayed_times);
+  if (recorded_times.total_ns > 0) {
+    fprintf(stderr, "Replay took %.1f%% of the recorded time\n",
+            100.0 * replayed_times.total_ns / recorded_times.total_ns);
+  }
+
+  // Which transfers account for the difference
+  std::map<RecordKey, std::pair<int64_t, int64_t>> totals;
+  for (size_t i = 0; i < replayed.size(); i++) {
+    auto &entry = totals[RecordKey(replayed[i].kind, replayed[i].opcode)];
+    entry.first += trace.records[i].duration_ns;
+    entry.second += replayed[i].duration_ns;
+  }
+  fprintf(stderr, "\n%-20s %-5s %12s %12s %12s\n", "opcode", "dir",
+          "recorded ms", "replayed ms", "delta ms");
+  for (auto &entry : totals) {
+    if (entry.first.first == Trace::Kind::EVENT)
+      continue;
+    fprintf(stderr, "%-20s %-5s %12.3f %12.3f %+12.3f\n",
+            UsbProto::opcode_name(entry.first.second),
+            kind_name(entry.first.first), entry.second.first / 1e6,
+            entry.second.second / 1e6,
+            (entry.second.second - entry.second.first) / 1e6);
+  }
+
+  if (chrome_path != nullptr && !write_chrome(chrome_path, replayed))
+    return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  try {
+    const char *command = argv[1];
+    if (!strcmp(command, "summary") && argc == 3) {
+      return summary(Trace::read(argv[2]));
+    } else if (!strcmp(command, "chrome") && argc == 4) {
+      return write_chrome(argv[3], Trace::read(argv[2]).records)
+                 ? EXIT_SUCCESS
+                 : EXIT_FAILURE;
+    } else if (!strcmp(command, "replay")) {
+      return replay_command(argc - 1, argv + 1);
+    }
+  } catch (const Faff::Error &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return EXIT_FAILURE;
+  }
+
+  usage();
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,164 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <memory>
+
+#include <error.hpp>
+#include <tuning.hpp>
+#include <usb_protocol.hpp>
+
+namespace Faff {
+
+// Every profile key, where it lives in Tuning, and the values faff can work
+// with. A zero timeout means wait forever to libusb, and a huge read block is
+// allocated up front, so hand edited profiles are held to these.
+struct TuningField {
+  const char *key;
+  unsigned Tuning::*value;
+  unsigned min;
+  unsigned max;
+};
+
+/* clang-format off */
+static const TuningField tuning_fields[] = {
+    {"command_timeout_ms",      &Tuning::command_timeout_ms,      1, 60000},
+    {"bulk_timeout_us_per_kib", &Tuning::bulk_timeout_us_per_kib, 1, 1000000},
+    {"poll_interval_us",        &Tuning::poll_interval_us,        1, 1000000},
+    {"write_chunk",             &Tuning::write_chunk,             1, UsbProto::max_write_size},
+    {"read_block",              &Tuning::read_block,              1, 1024 * 1024},
+    {"erase_4k_ms",             &Tuning::erase_4k_ms,             0, 60000},
+    {"erase_32k_ms",            &Tuning::erase_32k_ms,            0, 60000},
+    {"erase_64k_ms",            &Tuning::erase_64k_ms,            0, 60000},
+    {"page_program_us",         &Tuning::page_program_us,         0, 100000},
+};
+/* clang-format on */
+
+std::string tuning_profile_path(const std::string &serial) {
+  if (serial.empty())
+    return "";
+
+  std::string dir;
+  const char *config_home = getenv("XDG_CONFIG_HOME");
+  const char *home = getenv("HOME");
+  if (config_home != nullptr && config_home[0] != '\0') {
+    dir = config_home;
+  } else if (home != nullptr && home[0] != '\0') {
+    dir = std::string(home) + "/.config";
+  } else {
+    return "";
+  }
+
+  // Serials are usually hex, but don't let an odd one escape the directory
+  std::string name = serial;
+  for (char &c : name) {
+    if (c == '/' || c == '.' || c < ' ')
+      c = '_';
+  }
+  return dir + "/faff/" + name + ".conf";
+}
+
+bool load_tuning(const std::string &path, Tuning *out_tuning,
+                 std::vector<std::string> *out_unknown_keys) {
+  FILE *in = fopen(path.c_str(), "r");
+  if (in == nullptr) {
+    if (errno == ENOENT)
+      return false;
+    throw Error("Failed to open tuning profile '" + path +
+                "': " + strerror(errno));
+  }
+  std::shared_ptr<void> _defer_close(nullptr, [=](...) { fclose(in); });
+
+  Tuning tuning;
+  char line[256];
+  unsigned line_number = 0;
+  while (fgets(line, sizeof(line), in) != nullptr) {
+    line_number++;
+    char key[64];
+    char value[64];
+    if (line[0] == '#' || sscanf(line, "%63s", key) != 1)
+      continue;
+    const std::string where =
+        "Tuning profile '" + path + "' line " + std::to_string(line_number);
+    if (sscanf(line, "%63s %63s", key, value) != 2) {
+      throw Error(where + ": missing value");
+    }
+
+    char *end;
+    errno = 0;
+    const unsigned long parsed = strtoul(value, &end, 0);
+    if (*end != '\0' || errno == ERANGE) {
+      throw Error(where + ": bad value '" + value + "'");
+    }
+
+    // Flash ID bytes
+    uint8_t *id = !strcmp(key, "flash_mfgr")     ? &tuning.flash_mfgr
+                  : !strcmp(key, "flash_device") ? &tuning.flash_device
+                                                 : nullptr;
+    if (id != nullptr) {
+      if (parsed > 0xFF) {
+        throw Error(where + ": " + key + " must be at most 0xff");
+      }
+      *id = parsed;
+      continue;
+    }
+
+    const TuningField *field = nullptr;
+    for (const TuningField &candidate : tuning_fields) {
+      if (!strcmp(key, candidate.key)) {
+        field = &candidate;
+      }
+    }
+    if (field == nullptr) {
+      if (out_unknown_keys != nullptr) {
+        out_unknown_keys->push_back(key);
+      }
+      continue;
+    }
+    if (parsed < field->min || parsed > field->max) {
+      throw Error(where + ": " + key + " must be between " +
+                  std::to_string(field->min) + " and " +
+                  std::to_string(field->max));
+    }
+    tuning.*field->value = parsed;
+  }
+
+  *out_tuning = tuning;
+  return true;
+}
+
+void save_tuning(const std::string &path, const Tuning &tuning,
+                 const std::string &comment) {
+  // Create the faff directory, and the config directory above it if needed
+  const size_t faff_dir_end = path.rfind('/');
+  if (faff_dir_end != std::string::npos && faff_dir_end > 0) {
+    const std::string faff_dir = path.substr(0, faff_dir_end);
+    const size_t config_dir_end = faff_dir.rfind('/');
+    if (config_dir_end != std::string::npos && config_dir_end > 0) {
+      mkdir(faff_dir.substr(0, config_dir_end).c_str(), 0755);
+    }
+    if (mkdir(faff_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+      throw Error("Failed to create '" + faff_dir + "': " + strerror(errno));
+    }
+  }
+
+  FILE *out = fopen(path.c_str(), "w");
+  if (out == nullptr) {
+    throw Error("Failed to open tuning profile '" + path +
+                "' for writing: " + strerror(errno));
+  }
+  fprintf(out, "# %s\n", comment.c_str());
+  for (const TuningField &field : tuning_fields) {
+    fprintf(out, "%s %u\n", field.key, tuning.*field.value);
+  }
+  fprintf(out, "flash_mfgr 0x%02x\n", tuning.flash_mfgr);
+  fprintf(out, "flash_device 0x%02x\n", tuning.flash_device);
+  if (fclose(out) != 0) {
+    throw Error("Failed to write tuning profile '" + path + "'");
+  }
+}
+
+} // namespace Faff
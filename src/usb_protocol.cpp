@@ -1,16 +1,18 @@
+#include <stdio.h>
 #include <string.h>
 
+#include <error.hpp>
 #include <usb_protocol.hpp>
 
 namespace UsbProto {
 
-static const unsigned libusb_timeout_ms = 100;
-
 /*
 enum class Opcode : uint8_t {
   // General
   NOP = 0x00,
   SET_RGB_LED = 0x01,
+  QUERY_FEATURES = 0x02,
+  EVENTS_ENABLE = 0x03,
   // FPGA interface
   FPGA_RESET_ASSERT = 0x10,
   FPGA_RESET_DEASSERT = 0x11,
@@ -24,53 +26,218 @@ enum class Opcode : uint8_t {
   FLASH_WRITE = 0x25,
   FLASH_READ = 0x26,
   FLASH_QUERY_STATUS = 0x27,
+  FLASH_READ_BULK = 0x28,
+  FLASH_READ_SFDP = 0x29,
+  // SPI link configuration
+  SPI_QUERY_CONFIG = 0x30,
+  SPI_SET_CONFIG = 0x31,
+  // Device side sector jobs
+  SECTOR_JOB_LOAD = 0x40,
+  SECTOR_JOB_COMMIT = 0x41,
+  SECTOR_JOB_STATUS = 0x42,
+  // Shared SPI bus arbitration, for programming while the FPGA runs
+  SPI_BUS_ACQUIRE = 0x50,
+  SPI_BUS_RELEASE = 0x51,
 };
 */
+const char *opcode_name(uint8_t opcode) {
+  switch (static_cast<Opcode>(opcode)) {
+  case Opcode::NOP:
+    return "NOP";
+  case Opcode::SET_RGB_LED:
+    return "SET_RGB_LED";
+  case Opcode::QUERY_FEATURES:
+    return "QUERY_FEATURES";
+  case Opcode::EVENTS_ENABLE:
+    return "EVENTS_ENABLE";
+  case Opcode::FPGA_RESET_ASSERT:
+    return "FPGA_RESET_ASSERT";
+  case Opcode::FPGA_RESET_DEASSERT:
+    return "FPGA_RESET_DEASSERT";
+  case Opcode::FPGA_QUERY_STATUS:
+    return "FPGA_QUERY_STATUS";
+  case Opcode::FLASH_IDENTIFY:
+    return "FLASH_IDENTIFY";
+  case Opcode::FLASH_ERASE_4K:
+    return "FLASH_ERASE_4K";
+  case Opcode::FLASH_ERASE_32K:
+    return "FLASH_ERASE_32K";
+  case Opcode::FLASH_ERASE_64K:
+    return "FLASH_ERASE_64K";
+  case Opcode::FLASH_ERASE_CHIP:
+    return "FLASH_ERASE_CHIP";
+  case Opcode::FLASH_WRITE:
+    return "FLASH_WRITE";
+  case Opcode::FLASH_READ:
+    return "FLASH_READ";
+  case Opcode::FLASH_QUERY_STATUS:
+    return "FLASH_QUERY_STATUS";
+  case Opcode::FLASH_READ_BULK:
+    return "FLASH_READ_BULK";
+  case Opcode::FLASH_READ_SFDP:
+    return "FLASH_READ_SFDP";
+  case Opcode::SPI_QUERY_CONFIG:
+    return "SPI_QUERY_CONFIG";
+  case Opcode::SPI_SET_CONFIG:
+    return "SPI_SET_CONFIG";
+  case Opcode::SECTOR_JOB_LOAD:
+    return "SECTOR_JOB_LOAD";
+  case Opcode::SECTOR_JOB_COMMIT:
+    return "SECTOR_JOB_COMMIT";
+  case Opcode::SECTOR_JOB_STATUS:
+    return "SECTOR_JOB_STATUS";
+  case Opcode::SPI_BUS_ACQUIRE:
+    return "SPI_BUS_ACQUIRE";
+  case Opcode::SPI_BUS_RELEASE:
+    return "SPI_BUS_RELEASE";
+  }
+  return "UNKNOWN";
+}
+
+// Flash address carried in a command header, for the trace
+static uint32_t command_addr(const uint8_t *cmd, int length) {
+  const uint8_t *addr = nullptr;
+  switch (static_cast<Opcode>(cmd[0])) {
+  case Opcode::FLASH_ERASE_4K:
+  case Opcode::FLASH_ERASE_32K:
+  case Opcode::FLASH_ERASE_64K:
+  case Opcode::FLASH_WRITE:
+  case Opcode::FLASH_READ:
+  case Opcode::FLASH_READ_BULK:
+  case Opcode::FLASH_READ_SFDP:
+    addr = &cmd[1];
+    break;
+  case Opcode::SECTOR_JOB_COMMIT:
+    addr = &cmd[2];
+    break;
+  default:
+    return 0;
+  }
+  if (addr + 4 > cmd + length)
+    return 0;
+  return ((((uint32_t)addr[0]) << 24) | (((uint32_t)addr[1]) << 16) |
+          (((uint32_t)addr[2]) << 8) | (((uint32_t)addr[3]) << 0));
+}
+
+Session::~Session() { close(); }
+
+void Session::close() {
+  if (_usb_handle == nullptr)
+    return;
+  cancel_event_transfer();
+  _usb_handle = nullptr;
+}
+
+void Session::set_timeouts(unsigned command_timeout_ms,
+                           unsigned bulk_timeout_us_per_kib) {
+  _command_timeout_ms = command_timeout_ms;
+  _bulk_timeout_us_per_kib = bulk_timeout_us_per_kib;
+}
+
+unsigned Session::bulk_timeout_ms(uint32_t size) const {
+  return _command_timeout_ms +
+         (uint32_t)(((uint64_t)size * _bulk_timeout_us_per_kib) / 1024 / 1000);
+}
+
+int Session::bulk_transfer(uint8_t endpoint, uint8_t *data, int length,
+                           int *transferred, unsigned timeout_ms) {
+  if (_trace == nullptr) {
+    return libusb_bulk_transfer(_usb_handle, endpoint, data, length,
+                                transferred, timeout_ms);
+  }
+
+  Trace::Record record = {};
+  record.start_ns = _trace->now_ns();
+  const int ret = libusb_bulk_transfer(_usb_handle, endpoint, data, length,
+                                       transferred, timeout_ms);
+  const uint64_t duration_ns = _trace->now_ns() - record.start_ns;
+  record.duration_ns =
+      duration_ns > UINT32_MAX ? UINT32_MAX : (uint32_t)duration_ns;
+
+  // Responses don't say what they're for, so attribute them to the command
+  // that went out before them
+  if (endpoint & LIBUSB_ENDPOINT_IN) {
+    record.kind = Trace::Kind::RESPONSE;
+  } else {
+    record.kind = Trace::Kind::COMMAND;
+    _trace_opcode = length > 0 ? data[0] : 0;
+    _trace_addr = length > 0 ? command_addr(data, length) : 0;
+  }
+  record.endpoint = endpoint;
+  record.opcode = _trace_opcode;
+  record.result = ret;
+  record.addr = _trace_addr;
+  record.length = length;
+  record.transferred = *transferred;
+  record.timeout_ms = timeout_ms;
+  _trace->write(record);
+  return ret;
+}
+
 void Session::assert_libusb_ok(int code, const char *action) {
   if (code >= 0)
     return;
 
-  fprintf(stderr, "%s: %s (%d)\n", action, libusb_error_name(code), code);
-  exit(EXIT_FAILURE);
+  char message[256];
+  snprintf(message, sizeof(message), "%s: %s (%d)", action,
+           libusb_error_name(code), code);
+  throw Faff::Error(message);
 }
 
 void Session::cmd_set_rgb_led(uint8_t r, uint8_t g, uint8_t b) {
   uint8_t cmd_out[] = {static_cast<uint8_t>(Opcode::SET_RGB_LED), r, g, b};
   int transferred = 0;
-  int ret =
-      libusb_bulk_transfer(_usb_handle, _args._usb_endpoint_tx, cmd_out,
-                           sizeof(cmd_out), &transferred, libusb_timeout_ms);
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
   assert_libusb_ok(ret, "Failed to set LED colour");
 }
 
+uint32_t Session::cmd_query_features() {
+  uint8_t cmd_out[] = {static_cast<uint8_t>(Opcode::QUERY_FEATURES)};
+  int transferred = 0;
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
+  assert_libusb_ok(ret, "Failed to request firmware features");
+
+  // Read response. Firmware that doesn't know this command won't respond.
+  uint8_t resp[4];
+  ret = bulk_transfer(_options._usb_endpoint_rx, resp, sizeof(resp),
+                      &transferred, _command_timeout_ms);
+  if (ret == LIBUSB_ERROR_TIMEOUT)
+    return 0;
+  assert_libusb_ok(ret, "Failed to read firmware features response");
+  if (transferred != sizeof(resp))
+    return 0;
+
+  return ((((uint32_t)resp[0]) << 24) | (((uint32_t)resp[1]) << 16) |
+          (((uint32_t)resp[2]) << 8) | (((uint32_t)resp[3]) << 0));
+}
+
 void Session::cmd_fpga_reset_assert() {
   uint8_t cmd_out[] = {static_cast<uint8_t>(Opcode::FPGA_RESET_ASSERT)};
   int transferred = 0;
-  int ret =
-      libusb_bulk_transfer(_usb_handle, _args._usb_endpoint_tx, cmd_out,
-                           sizeof(cmd_out), &transferred, libusb_timeout_ms);
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
   assert_libusb_ok(ret, "Failed to set assert FPGA reset line");
 }
 
 void Session::cmd_fpga_reset_deassert() {
   uint8_t cmd_out[] = {static_cast<uint8_t>(Opcode::FPGA_RESET_DEASSERT)};
   int transferred = 0;
-  int ret =
-      libusb_bulk_transfer(_usb_handle, _args._usb_endpoint_tx, cmd_out,
-                           sizeof(cmd_out), &transferred, libusb_timeout_ms);
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
   assert_libusb_ok(ret, "Failed to deassert FPGA reset line");
 }
 
 void Session::cmd_fpga_query_status(uint8_t *out_status) {
   uint8_t cmd_out[] = {static_cast<uint8_t>(Opcode::FPGA_QUERY_STATUS)};
   int transferred = 0;
-  int ret =
-      libusb_bulk_transfer(_usb_handle, _args._usb_endpoint_tx, cmd_out,
-                           sizeof(cmd_out), &transferred, libusb_timeout_ms);
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
   assert_libusb_ok(ret, "Failed to request FPGA state");
   // Read response
-  ret = libusb_bulk_transfer(_usb_handle, _args._usb_endpoint_rx, out_status, 1,
-                             &transferred, libusb_timeout_ms);
+  ret = bulk_transfer(_options._usb_endpoint_rx, out_status, 1, &transferred,
+                      _command_timeout_ms);
   assert_libusb_ok(ret, "Failed to read FPGA state response");
 }
 
@@ -85,15 +252,14 @@ void Session::cmd_flash_identify(uint8_t *out_mfgr, uint8_t *out_device,
                                  uint64_t *out_unique_id) {
   uint8_t cmd_out[] = {static_cast<uint8_t>(Opcode::FLASH_IDENTIFY)};
   int transferred = 0;
-  int ret =
-      libusb_bulk_transfer(_usb_handle, _args._usb_endpoint_tx, cmd_out,
-                           sizeof(cmd_out), &transferred, libusb_timeout_ms);
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
   assert_libusb_ok(ret, "Failed to request Flash properties");
 
   // Read response
   uint8_t resp[10] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
-  ret = libusb_bulk_transfer(_usb_handle, _args._usb_endpoint_rx, resp,
-                             sizeof(resp), &transferred, libusb_timeout_ms);
+  ret = bulk_transfer(_options._usb_endpoint_rx, resp, sizeof(resp),
+                      &transferred, _command_timeout_ms);
   assert_libusb_ok(ret, "Failed to read Flash properties response");
 
   // Pull out the mfgr/device
@@ -116,9 +282,8 @@ void Session::cmd_flash_erase_4k(uint32_t addr) {
       ((uint8_t)(addr >> 0)),
   };
   int transferred = 0;
-  int ret =
-      libusb_bulk_transfer(_usb_handle, _args._usb_endpoint_tx, cmd_out,
-                           sizeof(cmd_out), &transferred, libusb_timeout_ms);
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
   assert_libusb_ok(ret, "Failed to initiate 4k sector erase");
 }
 
@@ -131,9 +296,8 @@ void Session::cmd_flash_erase_32k(uint32_t addr) {
       ((uint8_t)(addr >> 0)),
   };
   int transferred = 0;
-  int ret =
-      libusb_bulk_transfer(_usb_handle, _args._usb_endpoint_tx, cmd_out,
-                           sizeof(cmd_out), &transferred, libusb_timeout_ms);
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
   assert_libusb_ok(ret, "Failed to initiate 32k sector erase");
 }
 
@@ -146,18 +310,16 @@ void Session::cmd_flash_erase_64k(uint32_t addr) {
       ((uint8_t)(addr >> 0)),
   };
   int transferred = 0;
-  int ret =
-      libusb_bulk_transfer(_usb_handle, _args._usb_endpoint_tx, cmd_out,
-                           sizeof(cmd_out), &transferred, libusb_timeout_ms);
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
   assert_libusb_ok(ret, "Failed to initiate 64k sector erase");
 }
 
 void Session::cmd_flash_erase_chip() {
   uint8_t cmd_out[] = {static_cast<uint8_t>(Opcode::FLASH_WRITE)};
   int transferred = 0;
-  int ret =
-      libusb_bulk_transfer(_usb_handle, _args._usb_endpoint_tx, cmd_out,
-                           sizeof(cmd_out), &transferred, libusb_timeout_ms);
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
   assert_libusb_ok(ret, "Failed to initiate chip erase");
 }
 
@@ -173,9 +335,8 @@ void Session::cmd_flash_write(uint32_t addr, const uint8_t *data,
   };
   memcpy(&cmd_out[6], data, size);
   int transferred = 0;
-  int ret =
-      libusb_bulk_transfer(_usb_handle, _args._usb_endpoint_tx, cmd_out,
-                           sizeof(cmd_out), &transferred, libusb_timeout_ms);
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
   assert_libusb_ok(ret, "Failed to initiate flash write");
 }
 
@@ -189,29 +350,344 @@ void Session::cmd_flash_read(uint32_t addr, uint8_t *out_data, uint8_t size) {
       size,
   };
   int transferred = 0;
-  int ret =
-      libusb_bulk_transfer(_usb_handle, _args._usb_endpoint_tx, cmd_out,
-                           sizeof(cmd_out), &transferred, libusb_timeout_ms);
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
   assert_libusb_ok(ret, "Failed to request Flash status");
   // Read response
-  ret = libusb_bulk_transfer(_usb_handle, _args._usb_endpoint_rx, out_data,
-                             size, &transferred, libusb_timeout_ms);
+  ret = bulk_transfer(_options._usb_endpoint_rx, out_data, size, &transferred,
+                      _command_timeout_ms);
   assert_libusb_ok(ret, "Failed to read Flash status response");
 }
 
+void Session::cmd_flash_read_bulk(uint32_t addr, uint8_t *out_data,
+                                  uint32_t size) {
+  uint8_t cmd_out[] = {
+      static_cast<uint8_t>(Opcode::FLASH_READ_BULK),
+      ((uint8_t)(addr >> 24)),
+      ((uint8_t)(addr >> 16)),
+      ((uint8_t)(addr >> 8)),
+      ((uint8_t)(addr >> 0)),
+      ((uint8_t)(size >> 24)),
+      ((uint8_t)(size >> 16)),
+      ((uint8_t)(size >> 8)),
+      ((uint8_t)(size >> 0)),
+  };
+  int transferred = 0;
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
+  assert_libusb_ok(ret, "Failed to request Flash bulk read");
+  // Read the whole response in one transfer, libusb will split it into
+  // packets for us.
+  ret = bulk_transfer(_options._usb_endpoint_rx, out_data, size, &transferred,
+                      bulk_timeout_ms(size));
+  assert_libusb_ok(ret, "Failed to read Flash bulk read response");
+  if ((uint32_t)transferred != size) {
+    char message[128];
+    snprintf(message, sizeof(message),
+             "Short Flash bulk read: expected %u bytes, got %d", size,
+             transferred);
+    throw Faff::Error(message);
+  }
+}
+
+void Session::cmd_flash_read_sfdp(uint32_t addr, uint8_t *out_data,
+                                  uint8_t size) {
+  uint8_t cmd_out[] = {
+      static_cast<uint8_t>(Opcode::FLASH_READ_SFDP),
+      ((uint8_t)(addr >> 24)),
+      ((uint8_t)(addr >> 16)),
+      ((uint8_t)(addr >> 8)),
+      ((uint8_t)(addr >> 0)),
+      size,
+  };
+  int transferred = 0;
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
+  assert_libusb_ok(ret, "Failed to request Flash SFDP data");
+  // Read response
+  ret = bulk_transfer(_options._usb_endpoint_rx, out_data, size, &transferred,
+                      _command_timeout_ms);
+  assert_libusb_ok(ret, "Failed to read Flash SFDP response");
+}
+
 void Session::cmd_flash_query_status(uint8_t *out_status) {
   uint8_t cmd_out[] = {static_cast<uint8_t>(Opcode::FLASH_QUERY_STATUS)};
   int transferred = 0;
-  int ret =
-      libusb_bulk_transfer(_usb_handle, _args._usb_endpoint_tx, cmd_out,
-                           sizeof(cmd_out), &transferred, libusb_timeout_ms);
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
   assert_libusb_ok(ret, "Failed to request Flash status");
   // Read response
-  ret = libusb_bulk_transfer(_usb_handle, _args._usb_endpoint_rx, out_status, 1,
-                             &transferred, libusb_timeout_ms);
+  ret = bulk_transfer(_options._usb_endpoint_rx, out_status, 1, &transferred,
+                      _command_timeout_ms);
   assert_libusb_ok(ret, "Failed to read Flash status response");
 }
 
+bool Session::cmd_spi_query_config(SpiConfig *out_config) {
+  uint8_t cmd_out[] = {static_cast<uint8_t>(Opcode::SPI_QUERY_CONFIG)};
+  int transferred = 0;
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
+  assert_libusb_ok(ret, "Failed to request SPI configuration");
+
+  // Read response. Firmware that doesn't know this command won't respond.
+  // Layout is [io modes, current freq index, current mode, freq count,
+  //            freq count * big endian u32 kHz]
+  uint8_t resp[64];
+  ret = bulk_transfer(_options._usb_endpoint_rx, resp, sizeof(resp),
+                      &transferred, _command_timeout_ms);
+  if (ret == LIBUSB_ERROR_TIMEOUT)
+    return false;
+  assert_libusb_ok(ret, "Failed to read SPI configuration response");
+  if (transferred < 4 || transferred < 4 + resp[3] * 4)
+    return false;
+
+  out_config->io_modes = resp[0];
+  out_config->frequency_index = resp[1];
+  out_config->io_mode = static_cast<SpiIoMode>(resp[2]);
+  out_config->frequencies_khz.clear();
+  for (unsigned i = 0; i < resp[3]; i++) {
+    const uint8_t *freq = &resp[4 + i * 4];
+    out_config->frequencies_khz.push_back(
+        (((uint32_t)freq[0]) << 24) | (((uint32_t)freq[1]) << 16) |
+        (((uint32_t)freq[2]) << 8) | (((uint32_t)freq[3]) << 0));
+  }
+  return true;
+}
+
+bool Session::cmd_spi_set_config(uint8_t frequency_index, SpiIoMode mode) {
+  uint8_t cmd_out[] = {
+      static_cast<uint8_t>(Opcode::SPI_SET_CONFIG),
+      frequency_index,
+      static_cast<uint8_t>(mode),
+  };
+  int transferred = 0;
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
+  assert_libusb_ok(ret, "Failed to set SPI configuration");
+
+  // Read response, zero on success
+  uint8_t status = 0xFF;
+  ret = bulk_transfer(_options._usb_endpoint_rx, &status, 1, &transferred,
+                      _command_timeout_ms);
+  assert_libusb_ok(ret, "Failed to read SPI configuration status");
+  return status == 0;
+}
+
+void Session::cmd_sector_job_load(uint8_t slot, const uint8_t *data,
+                                  uint16_t size) {
+  // Header and payload go out as one transfer, which libusb splits into
+  // packets for us
+  std::vector<uint8_t> cmd_out(4 + size);
+  cmd_out[0] = static_cast<uint8_t>(Opcode::SECTOR_JOB_LOAD);
+  cmd_out[1] = slot;
+  cmd_out[2] = (uint8_t)(size >> 8);
+  cmd_out[3] = (uint8_t)(size >> 0);
+  memcpy(&cmd_out[4], data, size);
+  int transferred = 0;
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out.data(),
+                          cmd_out.size(), &transferred,
+                          bulk_timeout_ms(cmd_out.size()));
+  assert_libusb_ok(ret, "Failed to upload sector job");
+}
+
+void Session::cmd_sector_job_commit(uint8_t slot, uint32_t addr, uint32_t crc,
+                                    uint8_t flags) {
+  uint8_t cmd_out[] = {
+      static_cast<uint8_t>(Opcode::SECTOR_JOB_COMMIT),
+      slot,
+      ((uint8_t)(addr >> 24)),
+      ((uint8_t)(addr >> 16)),
+      ((uint8_t)(addr >> 8)),
+      ((uint8_t)(addr >> 0)),
+      ((uint8_t)(crc >> 24)),
+      ((uint8_t)(crc >> 16)),
+      ((uint8_t)(crc >> 8)),
+      ((uint8_t)(crc >> 0)),
+      flags,
+  };
+  int transferred = 0;
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
+  assert_libusb_ok(ret, "Failed to commit sector job");
+}
+
+void Session::cmd_sector_job_status(SectorJobState *out_states) {
+  uint8_t cmd_out[] = {static_cast<uint8_t>(Opcode::SECTOR_JOB_STATUS)};
+  int transferred = 0;
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
+  assert_libusb_ok(ret, "Failed to request sector job status");
+  // Read response, one state byte per slot
+  uint8_t resp[sector_job_slots];
+  ret = bulk_transfer(_options._usb_endpoint_rx, resp, sizeof(resp),
+                      &transferred, _command_timeout_ms);
+  assert_libusb_ok(ret, "Failed to read sector job status response");
+  for (unsigned i = 0; i < sector_job_slots; i++) {
+    out_states[i] = static_cast<SectorJobState>(resp[i]);
+  }
+}
+
+bool Session::cmd_spi_bus_acquire() {
+  uint8_t cmd_out[] = {static_cast<uint8_t>(Opcode::SPI_BUS_ACQUIRE)};
+  int transferred = 0;
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
+  assert_libusb_ok(ret, "Failed to request SPI bus");
+
+  // Read response, zero once the bus is ours
+  uint8_t status = 0xFF;
+  ret = bulk_transfer(_options._usb_endpoint_rx, &status, 1, &transferred,
+                      _command_timeout_ms + blocking_timeout_ms);
+  assert_libusb_ok(ret, "Failed to read SPI bus request status");
+  return status == 0;
+}
+
+void Session::cmd_spi_bus_release() {
+  uint8_t cmd_out[] = {static_cast<uint8_t>(Opcode::SPI_BUS_RELEASE)};
+  int transferred = 0;
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
+  assert_libusb_ok(ret, "Failed to release SPI bus");
+}
+
+void Session::cmd_events_enable(bool enable) {
+  uint8_t cmd_out[] = {static_cast<uint8_t>(Opcode::EVENTS_ENABLE), enable};
+  int transferred = 0;
+  int ret = bulk_transfer(_options._usb_endpoint_tx, cmd_out, sizeof(cmd_out),
+                          &transferred, _command_timeout_ms);
+  assert_libusb_ok(ret, "Failed to configure completion events");
+}
+
+void LIBUSB_CALL Session::event_transfer_callback(libusb_transfer *transfer) {
+  Session *session = static_cast<Session *>(transfer->user_data);
+  std::lock_guard<std::mutex> lock(session->_event_mutex);
+
+  if (transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+      transfer->actual_length >= 7) {
+    const uint8_t *data = transfer->buffer;
+    session->_events.push_back(Event{
+        static_cast<EventType>(data[0]),
+        data[1],
+        data[2],
+        (((uint32_t)data[3]) << 24) | (((uint32_t)data[4]) << 16) |
+            (((uint32_t)data[5]) << 8) | (((uint32_t)data[6]) << 0),
+    });
+
+    if (session->_trace != nullptr) {
+      const Event &event = session->_events.back();
+      Trace::Record record = {};
+      record.start_ns = session->_trace->now_ns();
+      record.kind = Trace::Kind::EVENT;
+      record.endpoint = transfer->endpoint;
+      record.opcode = static_cast<uint8_t>(event.type);
+      record.status = event.status;
+      record.addr = event.addr;
+      record.length = transfer->length;
+      record.transferred = transfer->actual_length;
+      session->_trace->write(record);
+    }
+  }
+
+  // Keep listening unless we were cancelled or the device went away
+  if (transfer->status == LIBUSB_TRANSFER_COMPLETED ||
+      transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+    if (libusb_submit_transfer(transfer) == 0)
+      return;
+  }
+  session->_event_transfer_active = false;
+}
+
+void Session::enable_completion_events(libusb_context *usb_context) {
+  if (_event_transfer != nullptr)
+    return;
+
+  _usb_context = usb_context;
+  _event_transfer = libusb_alloc_transfer(0);
+  if (_event_transfer == nullptr) {
+    throw Faff::Error("Failed to allocate event transfer");
+  }
+  // No timeout, events turn up whenever the flash is done
+  libusb_fill_interrupt_transfer(_event_transfer, _usb_handle,
+                                 _options._usb_endpoint_event, _event_buffer,
+                                 sizeof(_event_buffer),
+                                 event_transfer_callback, this, 0);
+  _event_transfer_active = true;
+  int ret = libusb_submit_transfer(_event_transfer);
+  if (ret < 0) {
+    _event_transfer_active = false;
+    libusb_free_transfer(_event_transfer);
+    _event_transfer = nullptr;
+    assert_libusb_ok(ret, "Failed to listen for completion events");
+  }
+  cmd_events_enable(true);
+}
+
+void Session::disable_completion_events() {
+  if (_event_transfer == nullptr)
+    return;
+  cmd_events_enable(false);
+  cancel_event_transfer();
+}
+
+void Session::cancel_event_transfer() {
+  if (_event_transfer == nullptr)
+    return;
+
+  // Wait for the cancellation to land before freeing the transfer
+  libusb_cancel_transfer(_event_transfer);
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> lock(_event_mutex);
+      if (!_event_transfer_active)
+        break;
+    }
+    struct timeval timeout = {0, 10'000};
+    libusb_handle_events_timeout_completed(_usb_context, &timeout, nullptr);
+  }
+  libusb_free_transfer(_event_transfer);
+  _event_transfer = nullptr;
+  std::lock_guard<std::mutex> lock(_event_mutex);
+  _events.clear();
+}
+
+bool Session::wait_event(EventType type, uint32_t addr,
+                         std::chrono::steady_clock::time_point deadline,
+                         Event *out_event) {
+  for (;;) {
+    {
+      // Leave anything that isn't what we're after, the caller may be
+      // waiting on more than one operation at once
+      std::lock_guard<std::mutex> lock(_event_mutex);
+      for (auto it = _events.begin(); it != _events.end(); ++it) {
+        if (it->type == type && it->addr == addr) {
+          *out_event = *it;
+          _events.erase(it);
+          return true;
+        }
+      }
+      if (!_event_transfer_active) {
+        throw Faff::Error("Lost completion event endpoint");
+      }
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    if (now >= deadline)
+      return false;
+
+    // Sleep in libusb until something happens on the bus, in slices so that
+    // we notice events handled on other threads too
+    const auto remaining =
+        std::chrono::duration_cast<std::chrono::microseconds>(deadline - now);
+    struct timeval timeout = {0, 10'000};
+    if (remaining.count() < timeout.tv_usec) {
+      timeout.tv_usec = remaining.count();
+    }
+    int ret =
+        libusb_handle_events_timeout_completed(_usb_context, &timeout, nullptr);
+    assert_libusb_ok(ret, "Failed to handle USB events");
+  }
+}
+
 bool Session::flash_busy() {
   uint8_t flash_status;
   cmd_flash_query_status(&flash_status);